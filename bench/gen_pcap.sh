@@ -0,0 +1,68 @@
+#!/bin/sh
+# SPDX-License-Identifier: BSD-3-Clause
+# Copyright 2018 Jonathan Ribas, FraudBuster. All rights reserved.
+#
+# Generate a pcap file of at least NB_PKTS ethernet frames whose sizes cycle
+# over the given mix, ie:
+#   gen_pcap.sh 64,64,64,64,64,64,64,576,576,576,576,1500 imix.pcap
+# The frames are only made of an ethernet header (local experimental
+# ethertype) and zeros, which is enough for the virtual devices.
+
+set -e
+
+if [ $# -ne 2 ]; then
+    echo "usage: $0 SIZE[,SIZE...] FILE" >&2
+    exit 1
+fi
+SIZES=$(echo "$1" | tr ',' ' ')
+OUT=$2
+NB_PKTS=${NB_PKTS:-16384}
+
+# little endian integers
+le16() {
+    printf "$(printf '\\%03o\\%03o' $(($1 & 255)) $(($1 >> 8 & 255)))"
+}
+le32() {
+    le16 $(($1 & 65535))
+    le16 $(($1 >> 16 & 65535))
+}
+
+# one frame of each size of the mix
+BLOCK=$OUT.block
+: > "$BLOCK"
+nb_block=0
+for sz in $SIZES; do
+    if [ "$sz" -lt 14 ] || [ "$sz" -gt 65535 ]; then
+        echo "$0: bad frame size $sz" >&2
+        rm -f "$BLOCK"
+        exit 1
+    fi
+    {
+        le32 0          # ts_sec
+        le32 $nb_block  # ts_usec
+        le32 "$sz"      # incl_len
+        le32 "$sz"      # orig_len
+        printf '\002\000\000\000\000\002\002\000\000\000\000\001\210\265'
+        head -c $((sz - 14)) /dev/zero
+    } >> "$BLOCK"
+    nb_block=$((nb_block + 1))
+done
+
+# the mix doubled up to NB_PKTS frames, after the global header
+nb=$nb_block
+while [ $nb -lt "$NB_PKTS" ]; do
+    cat "$BLOCK" "$BLOCK" > "$BLOCK.2"
+    mv "$BLOCK.2" "$BLOCK"
+    nb=$((nb * 2))
+done
+{
+    le32 2712847316     # magic 0xa1b2c3d4
+    le16 2              # version 2.4
+    le16 4
+    le32 0              # thiszone
+    le32 0              # sigfigs
+    le32 65535          # snaplen
+    le32 1              # ethernet
+    cat "$BLOCK"
+} > "$OUT"
+rm -f "$BLOCK"
@@ -0,0 +1,74 @@
+#!/bin/sh
+# SPDX-License-Identifier: BSD-3-Clause
+# Copyright 2018 Jonathan Ribas, FraudBuster. All rights reserved.
+#
+# NIC-less benchmark (make check): replay generated traces of several packet
+# sizes mixes on a net_null virtual device, through the whole loader and tx
+# engine, and report the pps and cycles per packet of each one, then replay
+# a single packet trace. Their --results csv are kept in BENCH_OUT to
+# compare builds.
+#
+# usage: run_bench.sh [DPDK_REPLAY]
+# env: BENCH_DURATION (seconds per mix, 2 by default), BENCH_OUT
+#      (bench-results by default), NB_PKTS (frames per trace), BENCH_ARGS
+#      (more dpdk-replay options, ie: --cores-per-port 2).
+
+DPDK_REPLAY=${1:-src/dpdk-replay}
+BENCH_DURATION=${BENCH_DURATION:-2}
+BENCH_OUT=${BENCH_OUT:-bench-results}
+SRCDIR=$(dirname "$0")
+
+# name:sizes mixes, replayed during BENCH_DURATION
+MIXES="64:64 512:512 1500:1500 imix:64,64,64,64,64,64,64,576,576,576,576,1500"
+# a single pkt trace, in as many runs as its refcnt covers without re-arm
+TINY_RUNS=32768
+
+if [ ! -x "$DPDK_REPLAY" ]; then
+    echo "$0: $DPDK_REPLAY not found, build it first." >&2
+    exit 1
+fi
+# DPDK needs hugepages: nothing to measure without them
+free=0
+for f in /sys/kernel/mm/hugepages/hugepages-*/free_hugepages; do
+    [ -r "$f" ] && free=$((free + $(cat "$f")))
+done
+if [ $free -eq 0 ]; then
+    echo "$0: no free hugepages, benchmark skipped."
+    exit 0
+fi
+
+mkdir -p "$BENCH_OUT" || exit 1
+printf "%-6s %14s %10s %12s\n" "mix" "pps" "Gbit/s" "cycles/pkt"
+ret=0
+
+# bench_mix NAME SIZES NB_PKTS DPDK_REPLAY_OPTIONS...
+bench_mix() {
+    name=$1
+    trace=$BENCH_OUT/$name.pcap
+    csv=$BENCH_OUT/$name.csv
+    if ! NB_PKTS=$3 sh "$SRCDIR/gen_pcap.sh" "$2" "$trace"; then
+        ret=1
+        return
+    fi
+    shift 3
+    # net_null0:copy=1 reads the packets data, like a NIC doing its DMA
+    if ! "$DPDK_REPLAY" "$@" $BENCH_ARGS --results "csv:$csv" \
+         "$trace" net_null0:copy=1 > "$BENCH_OUT/$name.log" 2>&1; then
+        echo "$name: replay failed, see $BENCH_OUT/$name.log" >&2
+        ret=1
+        return
+    fi
+    # pps and Gbit/s of the total, cycles per packet averaged over the tx cores
+    awk -F, -v name="$name" '
+        /^#/ || $1 == "thread" { next }
+        $1 == "total" { pps = $10; gbps = $11; next }
+        { cycles += $13; nb++ }
+        END { printf "%-6s %14.0f %10.3f %12.1f\n", name, pps, gbps, nb ? cycles / nb : 0 }
+    ' "$csv"
+}
+
+for mix in $MIXES; do
+    bench_mix "${mix%%:*}" "${mix#*:}" "${NB_PKTS:-16384}" --duration "$BENCH_DURATION"
+done
+bench_mix tiny 64 1 --nbruns "$TINY_RUNS"
+exit $ret
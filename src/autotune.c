@@ -0,0 +1,287 @@
+/*
+  SPDX-License-Identifier: BSD-3-Clause
+  Copyright 2018 Jonathan Ribas, FraudBuster. All rights reserved.
+*/
+
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <rte_mbuf.h>
+#include <rte_cycles.h>
+#include <rte_launch.h>
+
+#include "main.h"
+
+/*
+  --autotune: once the caches are loaded, sweep the tx parameters with short
+  timed trials on the ports, and keep the combination giving the best rate.
+  A profile file saves it for the next replays (see --profile).
+*/
+
+static const unsigned int   at_bursts[] = { 32, 64, 128 };
+static const unsigned int   at_queues[] = { 4, 16, 64 };
+static const unsigned int   at_descs[] = { 512, 1024, 4096 };
+static const int            at_free_threshs[] = { -1, 32, 128 }; /* -1: driver's */
+
+#define NB_ELEMS(tab) (sizeof(tab) / sizeof(*(tab)))
+
+/* parse a profile file: "option value" lines, '#' starting comments */
+int load_profile(struct cmd_opts* opts, const char* path)
+{
+    FILE*   f;
+    char    line[256];
+    char    key[64];
+    int     val, nb_line, ret = 0;
+
+    if (!opts || !path)
+        return (EINVAL);
+
+    f = fopen(path, "r");
+    if (!f) {
+        printf("open of %s failed: %s\n", path, strerror(errno));
+        return (errno);
+    }
+    for (nb_line = 1; !ret && fgets(line, sizeof(line), f); nb_line++) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%63s %i", key, &val) != 2)
+            ret = EPROTO;
+        else if (!strcmp(key, "burst") && val > 0 && val <= BURST_SZ)
+            opts->burst_sz = val;
+        else if (!strcmp(key, "tx-queues") && val > 0 && val <= MAX_TX_QUEUES)
+            opts->tx_queues = val;
+        else if (!strcmp(key, "tx-desc") && val > 0 && val <= UINT16_MAX)
+            opts->tx_desc = val;
+        else if (!strcmp(key, "tx-free-thresh") && val >= -1 && val <= UINT16_MAX)
+            opts->tx_thresh[3] = val;
+        else
+            ret = EPROTO;
+        if (ret)
+            printf("%s:%i: bad profile line: %s", path, nb_line, line);
+    }
+    fclose(f);
+    return (ret);
+}
+
+static int save_profile(const struct cmd_opts* opts, const char* path)
+{
+    FILE*   f;
+
+    f = fopen(path, "w");
+    if (!f) {
+        printf("open of %s failed: %s\n", path, strerror(errno));
+        return (errno);
+    }
+    fprintf(f, "# dpdk-replay tx profile, found by --autotune with %s\n", opts->trace);
+    fprintf(f, "burst %u\n", opts->burst_sz);
+    fprintf(f, "tx-queues %u\n", opts->tx_queues);
+    fprintf(f, "tx-desc %u\n", opts->tx_desc);
+    fprintf(f, "tx-free-thresh %i\n", opts->tx_thresh[3]);
+    if (fclose(f)) {
+        printf("write of %s failed: %s\n", path, strerror(errno));
+        return (errno);
+    }
+    printf("-> Profile saved in %s, use it with --profile.\n", path);
+    return (0);
+}
+
+/*
+  Give the cached mbufs their refcnt back. The ports are stopped, so no one
+  else holds them.
+*/
+static void rearm_caches(const struct cpus_bindings* cpus, const struct dpdk_ctx* dpdk,
+                         const struct pcap_ctx* pcap)
+{
+    struct rte_mbuf*    seg;
+    unsigned int        port, i;
+
+    for (port = 0; port < cpus->nb_ports; port++)
+        for (i = 0; i < pcap->nb_pkts; i++)
+            for (seg = dpdk->pcap_caches[port].mbufs[i]; seg; seg = seg->next)
+                rte_mbuf_refcnt_set(seg, dpdk->armed_runs);
+    return ;
+}
+
+/*
+  The tx rings of a trial, as dpdk_init_port configured them: the requested
+  tx queues and descriptors are lowered to the NIC limits, so several
+  combinations can give the same rings. Kept per port, after the burst and
+  the free threshold, to tell the trials already measured.
+*/
+#define TRIAL_KEY_SZ(nb_ports) (2 + 2 * (nb_ports))
+
+static void get_trial_key(const struct cmd_opts* trial, const struct cpus_bindings* cpus,
+                          const struct dpdk_ctx* dpdk, unsigned int* key)
+{
+    unsigned int    port;
+
+    key[0] = trial->burst_sz;
+    key[1] = trial->tx_thresh[3];
+    for (port = 0; port < cpus->nb_ports; port++) {
+        key[2 + 2 * port] = dpdk->nb_tx_queues[port];
+        key[3 + 2 * port] = dpdk->tx_ring_sz[port] / dpdk->nb_tx_queues[port];
+    }
+    return ;
+}
+
+/*
+  The tx queues and descriptors in effect, to print and save: the most of
+  all the ports, which gives back the same rings when requested again.
+*/
+static void get_tx_rings(const struct cpus_bindings* cpus, const struct dpdk_ctx* dpdk,
+                         unsigned int* tx_queues, unsigned int* tx_desc)
+{
+    unsigned int    port;
+
+    *tx_queues = *tx_desc = 0;
+    for (port = 0; port < cpus->nb_ports; port++) {
+        *tx_queues = max(*tx_queues, dpdk->nb_tx_queues[port]);
+        *tx_desc = max(*tx_desc, dpdk->tx_ring_sz[port] / dpdk->nb_tx_queues[port]);
+    }
+    return ;
+}
+
+/* replay during a trial, and get the rates of all the ports */
+static int run_trial(const struct cmd_opts* opts, const struct cpus_bindings* cpus,
+                     const struct dpdk_ctx* dpdk, const struct pcap_ctx* pcap,
+                     double* pps, double* gbps, double* drop)
+{
+    struct thread_ctx*  ctx;
+    sem_t               sem;
+    unsigned long       total_pkt, total_drop;
+    unsigned int        i;
+    int                 ret;
+
+    if (sem_init(&sem, 0, 0)) {
+        fprintf(stderr, "sem_init failed: %s\n", strerror(errno));
+        return (errno);
+    }
+    ctx = init_tx_tasks(opts, cpus, dpdk, pcap, &sem);
+    if (!ctx)
+        return (ENOMEM);
+    /* --rewrite: the replay must start from the captured headers */
+    for (i = 0; i < cpus->nb_tasks; i++)
+        ctx[i].rw_pkts = NULL;
+    ret = arm_tx_tasks(cpus, dpdk, ctx);
+    if (!ret)
+        ret = launch_tx_tasks(cpus, ctx);
+    for (i = 0; !ret && i < cpus->nb_needed_cpus; i++)
+        ret = sem_post(&sem);
+    rte_eal_mp_wait_lcore();
+
+    *pps = *gbps = 0;
+    for (i = 0, total_pkt = total_drop = 0; i < cpus->nb_tasks; i++) {
+        if (!ctx[i].duration)
+            continue;
+        *pps += (ctx[i].total_pkt - ctx[i].total_drop) / ctx[i].duration;
+        *gbps += (ctx[i].total_pkt_sz - ctx[i].total_drop_sz) / ctx[i].duration
+            * 8 / 1000 / 1000 / 1000;
+        total_pkt += ctx[i].total_pkt;
+        total_drop += ctx[i].total_drop;
+    }
+    *drop = (total_pkt ? (double)total_drop * 100 / total_pkt : 0);
+    free(ctx);
+    sem_destroy(&sem);
+    return (ret);
+}
+
+int autotune(struct cmd_opts* opts, struct cpus_bindings* cpus, struct dpdk_ctx* dpdk,
+             const struct pcap_ctx* pcap)
+{
+    struct cmd_opts trial;
+    double          pps, gbps, drop, best_pps = 0;
+    unsigned int    armed_runs, b, q, d, f, i, nb_trials, nb_done, key_sz;
+    unsigned int*   keys;
+    int             ret = 0;
+
+    if (!opts || !cpus || !dpdk || !pcap)
+        return (EINVAL);
+
+    for (q = nb_trials = 0; q < NB_ELEMS(at_queues); q++)
+        nb_trials += (at_queues[q] >= cpus->cores_per_port);
+    nb_trials *= NB_ELEMS(at_bursts) * NB_ELEMS(at_descs) * NB_ELEMS(at_free_threshs);
+    key_sz = TRIAL_KEY_SZ(cpus->nb_ports);
+    keys = malloc(sizeof(*keys) * key_sz * (nb_trials + 1));
+    if (!keys)
+        return (ENOMEM);
+
+    /* the trials replay in loop, whatever the number of runs */
+    trial = *opts;
+    trial.nbruns = 1;
+    trial.loop_forever = 0;
+    trial.duration = (double)AUTOTUNE_TRIAL_MS / 1000;
+    armed_runs = dpdk->armed_runs;
+    dpdk->armed_runs = MBUF_REFCNT_ARM;
+
+    printf("-> Autotune: %u trials of %u ms.\n", nb_trials, AUTOTUNE_TRIAL_MS);
+    puts("   burst queues  desc  free |          pps   Gbit/s  dropped");
+    nb_done = 0;
+    for (b = 0; b < NB_ELEMS(at_bursts); b++)
+        for (q = 0; q < NB_ELEMS(at_queues); q++)
+            for (d = 0; d < NB_ELEMS(at_descs); d++)
+                for (f = 0; f < NB_ELEMS(at_free_threshs); f++) {
+                    if (at_queues[q] < cpus->cores_per_port)
+                        continue;
+                    trial.burst_sz = at_bursts[b];
+                    trial.tx_queues = at_queues[q];
+                    trial.tx_desc = at_descs[d];
+                    trial.tx_thresh[3] = at_free_threshs[f];
+                    /* a combination may not be supported by the NIC */
+                    if (restart_dpdk_ports(&trial, cpus, dpdk, 0)) {
+                        printf("   %5u %6u %5u %5i | setup failed\n", trial.burst_sz,
+                               trial.tx_queues, trial.tx_desc, trial.tx_thresh[3]);
+                        continue;
+                    }
+                    /* the rings in effect, lowered to the NIC limits */
+                    get_tx_rings(cpus, dpdk, &(trial.tx_queues), &(trial.tx_desc));
+                    printf("   %5u %6u %5u %5i | ", trial.burst_sz, trial.tx_queues,
+                           trial.tx_desc, trial.tx_thresh[3]);
+                    get_trial_key(&trial, cpus, dpdk, &(keys[nb_done * key_sz]));
+                    for (i = 0; i < nb_done; i++)
+                        if (!memcmp(&(keys[i * key_sz]), &(keys[nb_done * key_sz]),
+                                    sizeof(*keys) * key_sz))
+                            break;
+                    if (i < nb_done) {
+                        puts("already measured");
+                        continue;
+                    }
+                    nb_done++;
+                    fflush(stdout);
+                    rearm_caches(cpus, dpdk, pcap);
+                    /* ie: arm_tx_tasks refusing these rings for a tiny trace */
+                    if (run_trial(&trial, cpus, dpdk, pcap, &pps, &gbps, &drop)) {
+                        puts("trial failed");
+                        continue;
+                    }
+                    printf("%12.0f %8.3f %7.3f%%\n", pps, gbps, drop);
+                    if (pps <= best_pps)
+                        continue;
+                    best_pps = pps;
+                    opts->burst_sz = trial.burst_sz;
+                    opts->tx_queues = trial.tx_queues;
+                    opts->tx_desc = trial.tx_desc;
+                    opts->tx_thresh[3] = trial.tx_thresh[3];
+                }
+    free(keys);
+    if (!best_pps) {
+        puts("-> Autotune: no trial succeeded.");
+        ret = EIO;
+    }
+
+    /* configure the ports with the winner for the replay */
+    dpdk->armed_runs = armed_runs;
+    if (!ret)
+        ret = restart_dpdk_ports(opts, cpus, dpdk, 1);
+    if (ret)
+        return (ret);
+    rearm_caches(cpus, dpdk, pcap);
+    printf("-> Autotune: best rate with bursts of %u pkts, %u tx queues of %u"
+           " descriptors, free threshold %i (%.0f pps).\n", opts->burst_sz,
+           opts->tx_queues, opts->tx_desc, opts->tx_thresh[3], best_pps);
+    if (opts->autotune_save)
+        return (save_profile(opts, opts->autotune_save));
+    return (0);
+}
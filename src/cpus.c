@@ -13,65 +13,316 @@
 
 #include "main.h"
 
+/*
+  Numacore of a port, from the sysfs entry of its pci address. The virtual
+  devices and the NICs without numa information get the wanted numacore.
+*/
+static int get_port_numa(const struct cmd_opts* opts, const char* port)
+{
+    char    path[128];
+    FILE*   f;
+    int     numa = -1;
+
+    if (IS_VDEV(port))
+        return (opts->numacore);
+    /* the domain can be omitted in the pci address */
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s%s/numa_node",
+             (strchr(port, ':') == strrchr(port, ':') ? "0000:" : ""), port);
+    f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%i", &numa) != 1)
+            numa = -1;
+        fclose(f);
+    }
+    return (numa < 0 ? opts->numacore : numa);
+}
+
+/* find the numacore of the ports, and of the tx lcores sending them */
+static int find_numacores(const struct cmd_opts* opts, struct cpus_bindings* cpus)
+{
+    unsigned int    i, lcore;
+
+    cpus->numacores = (numa_available() < 0 ? 1 : numa_max_node() + 1);
+    cpus->numacore = opts->numacore;
+    if (cpus->numacore >= cpus->numacores) {
+        printf("--numacore %i: the system has %i numacores.\n", cpus->numacore,
+               cpus->numacores);
+        return (EINVAL);
+    }
+    cpus->port_numa = malloc(sizeof(*(cpus->port_numa)) * cpus->nb_ports);
+    cpus->lcore_numa = malloc(sizeof(*(cpus->lcore_numa)) * cpus->nb_needed_cpus);
+    if (!cpus->port_numa || !cpus->lcore_numa) {
+        printf("%s: malloc failed.\n", __FUNCTION__);
+        return (ENOMEM);
+    }
+    bzero(cpus->numa_ports, sizeof(cpus->numa_ports));
+    for (i = 0; i < cpus->nb_ports; i++) {
+        cpus->port_numa[i] = get_port_numa(opts, opts->pcicards[i]);
+        if (cpus->port_numa[i] >= MAX_NUMA_NODES) {
+            printf("port %s is on numacore %i, over the %i supported.\n",
+                   opts->pcicards[i], cpus->port_numa[i], MAX_NUMA_NODES);
+            return (ENODEV);
+        }
+        cpus->numa_ports[cpus->port_numa[i]]++;
+    }
+
+    /* a tx lcore is on the numacore of its first port */
+    for (lcore = 0; lcore < cpus->nb_needed_cpus; lcore++)
+        cpus->lcore_numa[lcore] = -1;
+    for (i = 0; i < cpus->nb_tasks; i++) {
+        lcore = cpus->task_lcore[i];
+        if (cpus->lcore_numa[lcore] < 0)
+            cpus->lcore_numa[lcore] = cpus->port_numa[i / cpus->cores_per_port];
+        else if (cpus->lcore_numa[lcore] != cpus->port_numa[i / cpus->cores_per_port])
+            printf("-> Warning: tx core %u sends ports of numacores %i and %i.\n", lcore,
+                   cpus->lcore_numa[lcore], cpus->port_numa[i / cpus->cores_per_port]);
+    }
+    for (i = 0; i < (unsigned int)cpus->numacores && i < MAX_NUMA_NODES; i++)
+        if (cpus->numa_ports[i])
+            printf("-> %u ports on numacore %u.\n", cpus->numa_ports[i], i);
+    return (0);
+}
+
+#define CPU_ONLINE      1
+#define CPU_ISOLATED    2 /* isolcpus or nohz_full: no housekeeping, fewer interrupts */
+#define CPU_USED        4
+
+/* the cpus of the system, to pick the tx ones */
+struct                  cpu_topo {
+    unsigned int        nb_cpus;
+    char*               flags;
+    int*                core; /* first cpu of the physical core (SMT siblings) */
+};
+
+/* set the flag on the cpus of a sysfs cpu list, ie: "2-5,8" */
+static void read_cpu_list(const char* path, struct cpu_topo* topo, const char flag)
+{
+    char    buf[8192];
+    char*   s;
+    FILE*   f;
+    long    first, last;
+
+    f = fopen(path, "r");
+    if (!f)
+        return ;
+    s = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    while (s && *s >= '0' && *s <= '9') {
+        first = strtol(s, &s, 10);
+        last = (*s == '-' ? strtol(s + 1, &s, 10) : first);
+        for (; first <= last && first < topo->nb_cpus; first++)
+            topo->flags[first] |= flag;
+        if (*s != ',')
+            break;
+        s++;
+    }
+    return ;
+}
+
+static int init_cpu_topo(struct cpu_topo* topo)
+{
+    char            path[128];
+    unsigned int    i;
+    FILE*           f;
+
+    topo->nb_cpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+    topo->flags = malloc(topo->nb_cpus);
+    topo->core = malloc(sizeof(*(topo->core)) * topo->nb_cpus);
+    if (!topo->flags || !topo->core)
+        return (ENOMEM);
+    bzero(topo->flags, topo->nb_cpus);
+
+    read_cpu_list("/sys/devices/system/cpu/online", topo, CPU_ONLINE);
+    for (i = 0; i < topo->nb_cpus && !(topo->flags[i] & CPU_ONLINE); i++) ;
+    if (i == topo->nb_cpus) /* no sysfs: the online ones are the first ones */
+        for (i = 0; i < (unsigned int)sysconf(_SC_NPROCESSORS_ONLN) && i < topo->nb_cpus; i++)
+            topo->flags[i] |= CPU_ONLINE;
+    read_cpu_list("/sys/devices/system/cpu/isolated", topo, CPU_ISOLATED);
+    read_cpu_list("/sys/devices/system/cpu/nohz_full", topo, CPU_ISOLATED);
+    for (i = 0; i < topo->nb_cpus; i++) {
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", i);
+        f = fopen(path, "r");
+        if (!f || fscanf(f, "%i", &(topo->core[i])) != 1)
+            topo->core[i] = i;
+        if (f)
+            fclose(f);
+    }
+    return (0);
+}
+
+/* is a SMT sibling of the cpu already used */
+static int sibling_used(const struct cpu_topo* topo, const unsigned int cpu)
+{
+    unsigned int    i;
+
+    for (i = 0; i < topo->nb_cpus; i++)
+        if (i != cpu && topo->core[i] == topo->core[cpu] && (topo->flags[i] & CPU_USED))
+            return (1);
+    return (0);
+}
+
+/*
+  Take the best unused cpu of the numacore: for the tx lcores, an isolated
+  one whose SMT siblings are idle. The main lcore rather takes a housekeeping
+  cpu, to leave the isolated ones to the tx lcores.
+*/
+static int take_cpu(struct cpu_topo* topo, const int numa, const int tx)
+{
+    unsigned int    i;
+    int             best, best_score, score;
+
+    for (i = 0, best = -1, best_score = -1; i < topo->nb_cpus; i++) {
+        if (!(topo->flags[i] & CPU_ONLINE) || (topo->flags[i] & CPU_USED) ||
+            numa_node_of_cpu(i) != numa)
+            continue;
+        if (topo->flags[i] & CPU_ISOLATED)
+            score = (tx ? 2 : 0);
+        else
+            score = (tx ? 0 : 2);
+        score += !sibling_used(topo, i);
+        if (score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    if (best >= 0)
+        topo->flags[best] |= CPU_USED;
+    return (best);
+}
+
 static int find_cpus_to_use(const struct cmd_opts* opts, struct cpus_bindings* cpus)
 {
-    unsigned int        i;
-    unsigned int        cpu_cpt;
+    struct cpu_topo     topo;
+    unsigned int        i, nb_isolated, nb_shared;
+    int                 cpu, numa, ret = 0;
 
     if (!opts || !cpus)
         return (EINVAL);
 
-    cpus->numacores = 1;
-    cpus->numacore = opts->numacore;
+    bzero(&topo, sizeof(topo));
     cpus->cpus_to_use = (void*)malloc(sizeof(*(cpus->cpus_to_use)) * (cpus->nb_needed_cpus + 1));
-    if (cpus->cpus_to_use == NULL) {
+    if (cpus->cpus_to_use == NULL || init_cpu_topo(&topo)) {
         printf("%s: malloc failed.\n", __FUNCTION__);
-        return (ENOMEM);
+        ret = ENOMEM;
+        goto find_cpusExit;
     }
+    cpus->nb_available_cpus = topo.nb_cpus;
 #ifdef DEBUG
     printf("CPU cores to use:");
 #endif /* DEBUG */
-    for (i = 0, cpu_cpt = 0; i < cpus->nb_available_cpus; i++) {
-        /* be sure that we get cores on the wanted numa */
-        if (cpus->numacore == numa_node_of_cpu(i)) {
-            cpus->cpus_to_use[cpu_cpt++] = i;
+    /* the first one is the fake master, on the wanted numacore */
+    for (i = 0, nb_isolated = nb_shared = 0; i < cpus->nb_needed_cpus + 1; i++) {
+        numa = (i ? cpus->lcore_numa[i - 1] : cpus->numacore);
+        cpu = take_cpu(&topo, numa, i);
+        if (cpu < 0)
+            break;
+        cpus->cpus_to_use[i] = cpu;
+        if (i) {
+            nb_isolated += !!(topo.flags[cpu] & CPU_ISOLATED);
+            nb_shared += sibling_used(&topo, cpu);
+        }
 #ifdef DEBUG
-            printf(" %i", i);
+        printf(" %i", cpu);
 #endif /* DEBUG */
-            if (cpu_cpt == cpus->nb_needed_cpus + 1) /* +1 to keep the first as fake master */
-                break;
-        } else cpus->numacores = 2;
     }
 #ifdef DEBUG
     putchar('\n');
 #endif /* DEBUG */
-    if (cpu_cpt < cpus->nb_needed_cpus + 1) {
-        printf("Wanted %i threads on numa %i, but found only %i CPUs.\n",
-               cpus->nb_needed_cpus + 1, cpus->numacore, cpu_cpt);
+    if (i < cpus->nb_needed_cpus + 1) {
+        printf("Not enough CPUs on numa %i for the %s.\n", numa,
+               i ? "tx threads of its ports" : "main thread");
+        ret = ENODEV;
+        goto find_cpusExit;
+    }
+    printf("-> Tx cores: %u isolated, %u sharing their physical core.\n",
+           nb_isolated, nb_shared);
+
+find_cpusExit:
+    if (ret) {
         free(cpus->cpus_to_use);
-        return (ENODEV);
+        cpus->cpus_to_use = NULL;
     }
-    return (0);
+    free(topo.flags);
+    free(topo.core);
+    return (ret);
 }
 
-static uint64_t generate_mask(const struct cpus_bindings* cpus, uint8_t number)
+/*
+  EAL lcores list: lcore i runs on the cpu i to use, so the main lcore is
+  always the fake master (lcore 0), and the cpu ids are not limited to the
+  64 of a coremask.
+*/
+static char* generate_lcores(const struct cpus_bindings* cpus)
 {
-    int      i;
-    uint64_t coremask;
+    char*           lcores;
+    unsigned int    i, len;
+    size_t          sz;
 
-    if (!cpus)
-        return (EINVAL);
+    sz = (cpus->nb_needed_cpus + 1) * 24;
+    lcores = malloc(sz);
+    if (!lcores)
+        return (NULL);
+    for (i = 0, len = 0; i < cpus->nb_needed_cpus + 1; i++)
+        len += snprintf(lcores + len, sz - len, "%s%u@%u", (i ? "," : ""), i,
+                        cpus->cpus_to_use[i]);
+#ifdef DEBUG
+    printf("%s for %u cores -> %s\n", __FUNCTION__, cpus->nb_needed_cpus + 1, lcores);
+#endif /* DEBUG */
+    return (lcores);
+}
+
+/*
+  Assign the tx tasks (one per port, or per slice of port with several cores
+  per port) to the tx lcores. Several ports can share a lcore, which then
+  interleaves their bursts.
+*/
+static int map_tasks_to_lcores(const struct cmd_opts* opts, struct cpus_bindings* cpus)
+{
+    unsigned int    i, nb_used;
+    char*           map;
+    long            lcore;
 
-    if ((0 == number) || ( 64 < number)) /* out of bounds */
+    cpus->nb_tasks = cpus->nb_ports * cpus->cores_per_port;
+    cpus->task_lcore = malloc(sizeof(*(cpus->task_lcore)) * cpus->nb_tasks);
+    if (!cpus->task_lcore) {
+        printf("%s: malloc failed.\n", __FUNCTION__);
+        return (ENOMEM);
+    }
+
+    /* default: one lcore per task */
+    for (i = 0; i < cpus->nb_tasks; i++)
+        cpus->task_lcore[i] = (opts->ports_per_core ? i / opts->ports_per_core : i);
+    cpus->nb_needed_cpus = cpus->task_lcore[cpus->nb_tasks - 1] + 1;
+    if (!opts->port_map)
         return (0);
 
-    /* generate coremask */
-    for (coremask = 0, i = 0; i < number; i++)
-        coremask |= (uint64_t)(1 << cpus->cpus_to_use[i]);
-#ifdef DEBUG
-    printf("%s for %u cores -> 0x%lx\n", __FUNCTION__, number, coremask);
-#endif /* DEBUG */
-    return (coremask);
+    /* --port-map: the lcore index of each port, in the order of the ports */
+    for (i = 0, map = opts->port_map, cpus->nb_needed_cpus = 0; *map; i++) {
+        lcore = strtol(map, &map, 10);
+        if (i >= cpus->nb_ports || lcore < 0 || lcore >= cpus->nb_ports ||
+            (*map != ',' && *map != '\0'))
+            break;
+        cpus->task_lcore[i] = lcore;
+        cpus->nb_needed_cpus = max(cpus->nb_needed_cpus, (unsigned int)lcore + 1);
+        if (*map == ',')
+            map++;
+    }
+    if (*map || i != cpus->nb_ports) {
+        printf("--port-map must give a tx core index (0 to %u) for each of the %u ports.\n",
+               cpus->nb_ports - 1, cpus->nb_ports);
+        return (EINVAL);
+    }
+    /* no idle lcore */
+    for (lcore = 0; lcore < cpus->nb_needed_cpus; lcore++) {
+        for (i = 0, nb_used = 0; i < cpus->nb_tasks; i++)
+            nb_used += (cpus->task_lcore[i] == lcore);
+        if (!nb_used) {
+            printf("--port-map: no port is sent by tx core %li.\n", lcore);
+            return (EINVAL);
+        }
+    }
+    return (0);
 }
 
 int init_cpus(const struct cmd_opts* opts, struct cpus_bindings* cpus)
@@ -82,26 +333,30 @@ int init_cpus(const struct cmd_opts* opts, struct cpus_bindings* cpus)
     if (!opts || !cpus)
         return (EINVAL);
 
-    /* get the number of available cpus */
-    cpus->nb_available_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
-#ifdef DEBUG
-    printf("available cpus: %i\n", cpus->nb_available_cpus);
-#endif /* DEBUG */
-
     /* calculate the number of needed cpu cores */
     for (i = 0; opts->pcicards[i]; i++);
-    cpus->nb_needed_cpus = i;
-    printf("-> Needed cpus: %i\n", cpus->nb_needed_cpus);
+    cpus->nb_ports = i;
+    cpus->cores_per_port = opts->cores_per_port;
+    ret = map_tasks_to_lcores(opts, cpus);
+    if (ret)
+        return (ret);
+    ret = find_numacores(opts, cpus);
+    if (ret)
+        return (ret);
+    if (cpus->nb_needed_cpus < cpus->nb_tasks)
+        printf("-> Needed cpus: %i (for %u ports)\n", cpus->nb_needed_cpus, cpus->nb_ports);
+    else
+        printf("-> Needed cpus: %i (%u per port)\n", cpus->nb_needed_cpus,
+               cpus->cores_per_port);
 
     /* lookup on cores ID to use */
     ret = find_cpus_to_use(opts, cpus);
     if (ret)
         return (ret);
 
-    /* generate coremask of selected cpu cores for dpdk init */
-    /* NOTES: get an extra one to not use the 0/master one. TODO: do better :) */
-    cpus->coremask = generate_mask(cpus, cpus->nb_needed_cpus + 1);
-    if (!cpus->coremask)
-        return (EINVAL);
+    /* generate the lcores list of selected cpu cores for dpdk init */
+    cpus->lcores = generate_lcores(cpus);
+    if (!cpus->lcores)
+        return (ENOMEM);
     return (0);
 }
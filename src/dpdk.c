@@ -4,18 +4,35 @@
 */
 
 #include <stdio.h>
+#include <strings.h>
 #include <unistd.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
 
 /* DPDK includes */
 #include <rte_version.h>
 #include <rte_ethdev.h>
 #include <rte_log.h>
 #include <rte_errno.h>
+#include <rte_memzone.h>
+#include <rte_ring.h>
+#include <rte_cycles.h>
+#include <rte_mbuf.h> /* and its dynamic fields, since 20.11 */
 
 #include "main.h"
 
+/* renamed in 21.11 */
+#if API_AT_LEAST_AS_RECENT_AS(20, 11) && !defined(RTE_ETH_TX_OFFLOAD_SEND_ON_TIMESTAMP)
+#define RTE_ETH_TX_OFFLOAD_SEND_ON_TIMESTAMP DEV_TX_OFFLOAD_SEND_ON_TIMESTAMP
+#endif
+#if API_AT_LEAST_AS_RECENT_AS(18, 8) && !defined(RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE)
+#define RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE DEV_TX_OFFLOAD_MBUF_FAST_FREE
+#endif
+#if API_AT_LEAST_AS_RECENT_AS(18, 8) && !defined(RTE_ETH_TX_OFFLOAD_MULTI_SEGS)
+#define RTE_ETH_TX_OFFLOAD_MULTI_SEGS DEV_TX_OFFLOAD_MULTI_SEGS
+#endif
+
 static struct rte_eth_conf ethconf = {
 #ifdef RTE_VER_YEAR
     /* version  > to 2.2.0, last one with old major.minor.patch system */
@@ -42,14 +59,14 @@ static struct rte_eth_conf ethconf = {
     },
 };
 
-static struct rte_eth_txconf const txconf = {
-    .tx_thresh = {
-        .pthresh = TX_PTHRESH,
-        .hthresh = TX_HTHRESH,
-        .wthresh = TX_WTHRESH,
-    },
-    .tx_free_thresh = 32,
-};
+/* set on SIGINT, to stop --loop-forever and --duration replays */
+static volatile int quit = 0;
+
+static void quit_handler(int sig __rte_unused)
+{
+    quit = 1;
+    return ;
+}
 
 void* myrealloc(void* ptr, size_t new_size)
 {
@@ -59,70 +76,179 @@ void* myrealloc(void* ptr, size_t new_size)
     return (res);
 }
 
+/*
+  The args of the virtual devices are written in vdevs, allocated here and
+  to be freed by the caller once the EAL is initialized.
+*/
 char** fill_eal_args(const struct cmd_opts* opts, const struct cpus_bindings* cpus,
-                     const struct dpdk_ctx* dpdk, int* eal_args_ac)
+                     const struct dpdk_ctx* dpdk, int* eal_args_ac, char** vdevs)
 {
-    char    buf_coremask[30];
     char**  eal_args;
-    int     i, cpt;
+    char*   devargs;
+    size_t  sz;
+    int     i, cpt, nb_pci;
 
-    if (!opts || !cpus || !dpdk)
+    if (!opts || !cpus || !dpdk || !vdevs)
+        return (NULL);
+
+    for (i = 0, sz = 1; opts->pcicards[i]; i++)
+        if (IS_VDEV(opts->pcicards[i]))
+            sz += strlen(opts->pcicards[i]) + 1;
+    *vdevs = devargs = malloc(sz);
+    if (!devargs)
         return (NULL);
 
     /* Set EAL init parameters */
-    snprintf(buf_coremask, 20, "0x%lx", cpus->coremask);
     char *pre_eal_args[] = {
         "./dpdk-replay",
-        "-c", strdup(buf_coremask),
+        "--lcores", cpus->lcores,
         "-n", "1", /* NUM MEM CHANNELS */
         "--proc-type", "auto",
         "--file-prefix", "dpdkreplay_",
         NULL
     };
-    /* fill pci whitelist args */
+    /* fill pci whitelist and virtual devices args */
     eal_args = malloc(sizeof(*eal_args) * sizeof(pre_eal_args));
     if (!eal_args)
-        return (NULL);
+        goto fillEalArgsFailed;
     memcpy(eal_args, (char**)pre_eal_args, sizeof(pre_eal_args));
     cpt = sizeof(pre_eal_args) / sizeof(*pre_eal_args);
-    for (i = 0; opts->pcicards[i]; i++) {
+    for (i = nb_pci = 0; opts->pcicards[i]; i++) {
         eal_args = myrealloc(eal_args, sizeof(char*) * (cpt + 2));
         if (!eal_args)
-            return (NULL);
-        eal_args[cpt - 1] = "--pci-whitelist"; /* overwrite "NULL" */
-        eal_args[cpt] = opts->pcicards[i];
+            goto fillEalArgsFailed;
+        if (IS_VDEV(opts->pcicards[i])) {
+            /* the vdev args are separated by ':' in the ports list */
+            strcpy(devargs, opts->pcicards[i]);
+            for (eal_args[cpt] = devargs; *devargs; devargs++)
+                if (*devargs == ':')
+                    *devargs = ',';
+            devargs++;
+            eal_args[cpt - 1] = "--vdev"; /* overwrite "NULL" */
+        } else {
+            eal_args[cpt - 1] = "--pci-whitelist"; /* overwrite "NULL" */
+            eal_args[cpt] = opts->pcicards[i];
+            nb_pci++;
+        }
         eal_args[cpt + 1] = NULL;
         cpt += 2;
     }
+    /* with virtual devices only, don't probe the NICs bound to DPDK */
+    if (!nb_pci) {
+        eal_args = myrealloc(eal_args, sizeof(char*) * (cpt + 1));
+        if (!eal_args)
+            goto fillEalArgsFailed;
+        eal_args[cpt - 1] = "--no-pci";
+        eal_args[cpt] = NULL;
+        cpt++;
+    }
     *eal_args_ac = cpt - 1;
     return (eal_args);
+
+fillEalArgsFailed:
+    free(*vdevs);
+    *vdevs = NULL;
+    return (NULL);
 }
 
-int dpdk_init_port(const struct cpus_bindings* cpus, int port)
+/*
+  Configure a port from its capabilities: the wanted number of tx queues and
+  descriptors are capped to the NIC limits, and the tx thresholds are the
+  driver defaults, unless given on the command line.
+*/
+int dpdk_init_port(const struct cmd_opts* opts, const struct cpus_bindings* cpus,
+                   struct dpdk_ctx* dpdk, int port, const int verbose)
 {
-    int                 ret, i;
+    struct rte_eth_conf     conf = ethconf;
+    struct rte_eth_dev_info dev_info;
+    struct rte_eth_txconf   txconf;
+    uint16_t                nb_queues, nb_desc;
+    int                     ret, i;
 #ifdef DEBUG
-    struct rte_eth_link eth_link;
+    struct rte_eth_link     eth_link;
 #endif /* DEBUG */
 
-    if (!cpus)
+    if (!opts || !cpus || !dpdk)
         return (EINVAL);
 
+#if API_OLDEST_THAN(19, 11)
+    rte_eth_dev_info_get(port, &dev_info);
+#else /* if DPDK >= 19.11 */
+    ret = rte_eth_dev_info_get(port, &dev_info);
+    if (ret) {
+        fprintf(stderr, "DPDK: RTE ETH device info get failed: %s\n", strerror(-ret));
+        return (ret);
+    }
+#endif
+    nb_queues = min(opts->tx_queues, dev_info.max_tx_queues);
+    if (nb_queues < cpus->cores_per_port) {
+        fprintf(stderr, "port %i has only %u tx queues, for %u cores.\n",
+                port, nb_queues, cpus->cores_per_port);
+        return (EINVAL);
+    }
+    nb_desc = opts->tx_desc;
+
+    /* offloads API, without txq_flags, since 18.08 */
+#if API_AT_LEAST_AS_RECENT_AS(18, 8)
+    /*
+      The PMD gives the mbufs back to the mempool without checking their
+      refcnt, so only when streaming on a single port (their refcnt is 1).
+    */
+    if (dpdk->stream.rings && dpdk->stream.nb_rings == 1)
+        conf.txmode.offloads |= (dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE);
+    /* --multi-segs: the big pkts are chains of mbufs */
+    if (opts->multi_segs) {
+        if (!(dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MULTI_SEGS)) {
+            fprintf(stderr, "port %i can't send multi segments pkts (--multi-segs).\n", port);
+            return (ENOTSUP);
+        }
+        conf.txmode.offloads |= RTE_ETH_TX_OFFLOAD_MULTI_SEGS;
+    }
+#endif /* API_AT_LEAST_AS_RECENT_AS(18, 8) */
+#if API_AT_LEAST_AS_RECENT_AS(20, 11)
+    /* let the NIC send the pkts at their timestamp */
+    if (dpdk->tx_ts)
+        conf.txmode.offloads |= RTE_ETH_TX_OFFLOAD_SEND_ON_TIMESTAMP;
+#endif /* API_AT_LEAST_AS_RECENT_AS(20, 11) */
+
     /* Configure for each port (ethernet device), the number of rx queues & tx queues */
     if (rte_eth_dev_configure(port,
                               0, /* nb rx queue */
-                              NB_TX_QUEUES, /* nb tx queue */
-                              &ethconf) < 0) {
+                              nb_queues, /* nb tx queue */
+                              &conf) < 0) {
         fprintf(stderr, "DPDK: RTE ETH Ethernet device configuration failed\n");
         return (-1);
     }
+#if API_AT_LEAST_AS_RECENT_AS(17, 05)
+    ret = rte_eth_dev_adjust_nb_rx_tx_desc(port, NULL, &nb_desc);
+    if (ret) {
+        fprintf(stderr, "DPDK: RTE ETH descriptors adjust failed: %s\n", strerror(-ret));
+        return (ret);
+    }
+#endif /* API_AT_LEAST_AS_RECENT_AS(17, 05) */
+
+    txconf = dev_info.default_txconf;
+#if API_AT_LEAST_AS_RECENT_AS(18, 8)
+    txconf.offloads = conf.txmode.offloads;
+#else /* if DPDK < 18.08 */
+    if (opts->multi_segs)
+        txconf.txq_flags &= ~ETH_TXQ_FLAGS_NOMULTSEGS;
+#endif /* API_AT_LEAST_AS_RECENT_AS(18, 8) */
+    if (opts->tx_thresh[0] >= 0)
+        txconf.tx_thresh.pthresh = opts->tx_thresh[0];
+    if (opts->tx_thresh[1] >= 0)
+        txconf.tx_thresh.hthresh = opts->tx_thresh[1];
+    if (opts->tx_thresh[2] >= 0)
+        txconf.tx_thresh.wthresh = opts->tx_thresh[2];
+    if (opts->tx_thresh[3] >= 0)
+        txconf.tx_free_thresh = opts->tx_thresh[3];
 
     /* Then allocate and set up the transmit queues for this Ethernet device  */
-    for (i = 0; i < NB_TX_QUEUES; i++) {
+    for (i = 0; i < nb_queues; i++) {
         ret = rte_eth_tx_queue_setup(port,
                                      i,
-                                     TX_QUEUE_SIZE,
-                                     cpus->numacore,
+                                     nb_desc,
+                                     cpus->port_numa[port],
                                      &txconf);
         if (ret < 0) {
             fprintf(stderr, "DPDK: RTE ETH Ethernet device tx queue %i setup failed: %s",
@@ -130,12 +256,24 @@ int dpdk_init_port(const struct cpus_bindings* cpus, int port)
             return (ret);
         }
     }
+    dpdk->nb_tx_queues[port] = nb_queues;
+    dpdk->tx_ring_sz[port] = nb_queues * nb_desc;
+    if (verbose)
+        printf("-> NIC port %i: %u tx queues of %u descriptors (thresholds: %u/%u/%u,"
+               " free %u), tx offloads 0x%lx.\n", port, nb_queues, nb_desc,
+               txconf.tx_thresh.pthresh, txconf.tx_thresh.hthresh, txconf.tx_thresh.wthresh,
+               txconf.tx_free_thresh, (unsigned long)conf.txmode.offloads);
 
     /* Start the ethernet device */
     if (rte_eth_dev_start(port) < 0) {
         fprintf(stderr, "DPDK: RTE ETH Ethernet device start failed\n");
         return (-1);
     }
+    /* --rewrite waits for the sent pkts to be reclaimed (see tx_reclaim) */
+    dpdk->tx_done_cleanup[port] = 0;
+#if API_AT_LEAST_AS_RECENT_AS(19, 11)
+    dpdk->tx_done_cleanup[port] = (rte_eth_tx_done_cleanup(port, 0, 0) >= 0);
+#endif /* API_AT_LEAST_AS_RECENT_AS(19, 11) */
 
 #ifdef DEBUG
     /* Get link status and display it. */
@@ -152,14 +290,91 @@ int dpdk_init_port(const struct cpus_bindings* cpus, int port)
     return (0);
 }
 
+/* speed of the link of a port in Mbit/s, 0 if it's down or unknown */
+unsigned int get_link_speed(const int port)
+{
+    struct rte_eth_link eth_link;
+
+    bzero(&eth_link, sizeof(eth_link));
+    rte_eth_link_get_nowait(port, &eth_link);
+    if (!eth_link.link_status || eth_link.link_speed == UINT32_MAX)
+        return (0);
+    return (eth_link.link_speed);
+}
+
+static struct rte_mempool* create_mbuf_pool(const char* name, const unsigned long nb_mbufs,
+                                            const unsigned long mbuf_sz,
+                                            const unsigned int cache, const int numa)
+{
+    struct rte_mempool* pool;
+
+    printf("-> Create mempool of %lu mbufs of %lu octs on numacore %i.\n",
+           nb_mbufs, mbuf_sz, numa);
+    pool = rte_mempool_create(name,
+                              nb_mbufs,
+                              mbuf_sz,
+                              cache,
+                              sizeof(struct rte_pktmbuf_pool_private),
+                              rte_pktmbuf_pool_init, NULL,
+                              rte_pktmbuf_init, NULL,
+                              numa,
+                              0);
+    if (pool == NULL) {
+        fprintf(stderr, "DPDK: RTE Mempool %s creation failed (%s)\n",
+                name, rte_strerror(rte_errno));
+#if API_AT_LEAST_AS_RECENT_AS(18, 05)
+        if (rte_errno == ENOMEM
+            && (nb_mbufs * mbuf_sz /1024/1024) > RTE_MAX_MEM_MB_PER_LIST)
+            fprintf(stderr, "Your version of DPDK was configured to use at maximum"
+                    " %u Mo, or you try to allocate ~%lu Mo.\n"
+                    "Try to recompile DPDK by setting CONFIG_RTE_MAX_MEM_MB_PER_LIST"
+                    " according to your needs.\n", RTE_MAX_MEM_MB_PER_LIST,
+                    nb_mbufs * mbuf_sz /1024/1024);
+#endif /* API_AT_LEAST_AS_RECENT_AS(18, 05) */
+    }
+    return (pool);
+}
+
+/*
+  The ports list was sorted in the DPDK order (see main.c): check that the
+  DPDK port i is the i-th port of the list, as the numacore of each port and
+  the sending of the tx lcores rely on it.
+*/
+static int check_port_ids(const struct cmd_opts* opts, const unsigned int nb_ports)
+{
+    char            name[RTE_ETH_NAME_MAX_LEN], wanted[RTE_ETH_NAME_MAX_LEN];
+    const char*     port;
+    unsigned int    i;
+
+    for (i = 0; i < nb_ports; i++) {
+        port = opts->pcicards[i];
+        /* the device name, without its args or with the pci domain */
+        if (IS_VDEV(port))
+            snprintf(wanted, sizeof(wanted), "%.*s", (int)strcspn(port, ":"), port);
+        else
+            snprintf(wanted, sizeof(wanted), "%s%s",
+                     (strchr(port, ':') == strrchr(port, ':') ? "0000:" : ""), port);
+        name[0] = '\0';
+        if (rte_eth_dev_get_name_by_port(i, name) || strcasecmp(name, wanted)) {
+            fprintf(stderr, "DPDK port %u is %s, not %s: the ports list can't be matched"
+                    " with the DPDK ports.\n", i, name, wanted);
+            return (EINVAL);
+        }
+    }
+    return (0);
+}
+
 int init_dpdk_eal_mempool(const struct cmd_opts* opts,
                           const struct cpus_bindings* cpus,
                           struct dpdk_ctx* dpdk)
 {
     char**          eal_args;
+    char*           vdevs = NULL;
     int             eal_args_ac = 0;
     unsigned int    nb_ports;
-    int             ret;
+    char            name[RTE_MEMPOOL_NAMESIZE];
+    unsigned int    c;
+    int             ret, n;
 
     if (!opts || !cpus || !dpdk)
         return (EINVAL);
@@ -172,7 +387,7 @@ int init_dpdk_eal_mempool(const struct cmd_opts* opts,
 #endif
 
     /* craft an eal arg list */
-    eal_args = fill_eal_args(opts, cpus, dpdk, &eal_args_ac);
+    eal_args = fill_eal_args(opts, cpus, dpdk, &eal_args_ac, &vdevs);
     if (!eal_args) {
         printf("%s: fill_eal_args failed.\n", __FUNCTION__);
         return (1);
@@ -187,6 +402,7 @@ int init_dpdk_eal_mempool(const struct cmd_opts* opts,
     /* DPDK RTE EAL INIT */
     ret = rte_eal_init(eal_args_ac, eal_args);
     free(eal_args);
+    free(vdevs);
     if (ret < 0) {
         printf("%s: rte_eal_init failed (%d)\n", __FUNCTION__, ret);
         return (ret);
@@ -204,63 +420,176 @@ int init_dpdk_eal_mempool(const struct cmd_opts* opts,
 #else /* if DPDK >= 18.05 */
     nb_ports = rte_eth_dev_count_avail();
 #endif
-    if (nb_ports != cpus->nb_needed_cpus) {
+    if (nb_ports != cpus->nb_ports) {
         printf("%s error: wanted %u NIC ports, found %u\n", __FUNCTION__,
-               cpus->nb_needed_cpus, nb_ports);
+               cpus->nb_ports, nb_ports);
         return (1);
     }
+    ret = check_port_ids(opts, nb_ports);
+    if (ret)
+        return (ret);
+
+    for (n = 0; n < MAX_NUMA_NODES; n++) {
+        /* no mbuf holds packets data in zero copy mode */
+        for (c = 0; c < NB_MBUF_CLASSES; c++) {
+            if (!dpdk->nb_mbufs[n][c])
+                continue;
+            snprintf(name, sizeof(name), "dpdk_replay_mempool_%i_%u", n, c);
+            dpdk->pktmbuf_pools[n][c] = create_mbuf_pool(name, dpdk->nb_mbufs[n][c],
+                                                         dpdk->mbuf_szs[c],
+                                                         opts->mbuf_cache, n);
+            if (!dpdk->pktmbuf_pools[n][c])
+                return (rte_errno);
+        }
+
+        /* data-less mbufs of the ports caches, in shared cache and zero copy modes */
+        if (dpdk->nb_indirect_mbufs[n]) {
+            snprintf(name, sizeof(name), "dpdk_replay_indirect_%i", n);
+            dpdk->indirect_pools[n] = create_mbuf_pool(name, dpdk->nb_indirect_mbufs[n],
+                                                       dpdk->indirect_mbuf_sz,
+                                                       opts->mbuf_cache, n);
+            if (!dpdk->indirect_pools[n])
+                return (rte_errno);
+        }
+    }
+    return (0);
+}
+
+/*
+  normalspeed mode: use the tx timestamp offload if all the ports have it.
+  Must be called before caching the pcap file, whose mbufs are then stamped
+  with the time of their packet relatively to the run start, in ticks of the
+  device clock. Its rate is measured against the tsc.
+*/
+int init_tx_timestamp(const struct cmd_opts* opts,
+                      const struct cpus_bindings* cpus,
+                      struct dpdk_ctx* dpdk)
+{
+#if API_AT_LEAST_AS_RECENT_AS(20, 11)
+    struct rte_eth_dev_info dev_info;
+    uint64_t                clk_start, clk_end, tsc_start, tsc_end;
+    unsigned int            i;
+    int                     ret;
+#endif /* API_AT_LEAST_AS_RECENT_AS(20, 11) */
+
+    if (!opts || !cpus || !dpdk)
+        return (EINVAL);
+    if (!opts->normalspeed)
+        return (0);
+
+#if API_OLDEST_THAN(20, 11)
+    puts("-> No tx timestamp offload before DPDK 20.11: timings are done by software.");
+    return (0);
+#else
+    /* the token bucket only delays the tx threads, not the NIC */
+    if (opts->maxbitrate || opts->maxpps) {
+        puts("-> Tx timestamp offload not used with --maxbitrate/--maxpps.");
+        return (0);
+    }
+    for (i = 0; i < cpus->nb_ports; i++) {
+        ret = rte_eth_dev_info_get(i, &dev_info);
+        if (ret || !(dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_SEND_ON_TIMESTAMP)) {
+            printf("-> Port %u has no tx timestamp offload: timings are done by software.\n", i);
+            return (0);
+        }
+    }
+
+    dpdk->ts_ratio = malloc(sizeof(*(dpdk->ts_ratio)) * cpus->nb_ports);
+    if (!dpdk->ts_ratio)
+        return (ENOMEM);
+    for (i = 0; i < cpus->nb_ports; i++) {
+        tsc_start = rte_rdtsc();
+        ret = rte_eth_read_clock(i, &clk_start);
+        rte_delay_ms(TX_TS_CALIB_MS);
+        ret = (ret ? ret : rte_eth_read_clock(i, &clk_end));
+        tsc_end = rte_rdtsc();
+        if (ret || clk_end <= clk_start) {
+            printf("-> Can't read port %u clock: timings are done by software.\n", i);
+            return (0);
+        }
+        dpdk->ts_ratio[i] = (double)(clk_end - clk_start) * rte_get_tsc_hz()
+            / (tsc_end - tsc_start) / 1000000000;
+#ifdef DEBUG
+        printf("port %u clock: %f ticks per ns\n", i, dpdk->ts_ratio[i]);
+#endif /* DEBUG */
+    }
 
-    printf("-> Create mempool of %lu mbufs of %lu octs.\n",
-           dpdk->nb_mbuf, dpdk->mbuf_sz);
-    dpdk->pktmbuf_pool = rte_mempool_create("dpdk_replay_mempool",
-                                            dpdk->nb_mbuf,
-                                            dpdk->mbuf_sz,
-                                            MBUF_CACHE_SZ,
-                                            sizeof(struct rte_pktmbuf_pool_private),
-                                            rte_pktmbuf_pool_init, NULL,
-                                            rte_pktmbuf_init, NULL,
-                                            cpus->numacore,
-                                            0);
-    if (dpdk->pktmbuf_pool == NULL) {
-        fprintf(stderr, "DPDK: RTE Mempool creation failed (%s)\n",
+    ret = rte_mbuf_dyn_tx_timestamp_register(&(dpdk->ts_offset), &(dpdk->ts_flag));
+    if (ret) {
+        fprintf(stderr, "DPDK: tx timestamp dynfield registration failed (%s)\n",
                 rte_strerror(rte_errno));
-#if API_AT_LEAST_AS_RECENT_AS(18, 05)
-        if (rte_errno == ENOMEM
-            && (dpdk->nb_mbuf * dpdk->mbuf_sz /1024/1024) > RTE_MAX_MEM_MB_PER_LIST)
-            fprintf(stderr, "Your version of DPDK was configured to use at maximum"
-                    " %u Mo, or you try to allocate ~%lu Mo.\n"
-                    "Try to recompile DPDK by setting CONFIG_RTE_MAX_MEM_MB_PER_LIST"
-                    " according to your needs.\n", RTE_MAX_MEM_MB_PER_LIST,
-                    dpdk->nb_mbuf * dpdk->mbuf_sz /1024/1024);
-#endif /* API_AT_LEAST_AS_RECENT_AS(18, 05) */
         return (rte_errno);
     }
+    dpdk->tx_ts = 1;
+    puts("-> Pkts will be sent by the NICs at their timestamp (tx timestamp offload).");
     return (0);
+#endif /* API_OLDEST_THAN(20, 11) */
 }
 
-int init_dpdk_ports(struct cpus_bindings* cpus)
+int init_dpdk_ports(const struct cmd_opts* opts, struct cpus_bindings* cpus,
+                    struct dpdk_ctx* dpdk)
 {
     int i;
     int numa;
 
-    if (!cpus)
+    if (!opts || !cpus || !dpdk)
         return (EINVAL);
 
-    for (i = 0; (unsigned)i < cpus->nb_needed_cpus; i++) {
-        /* if the port ID isn't on the good numacore, exit */
+    dpdk->nb_tx_queues = malloc(sizeof(*(dpdk->nb_tx_queues)) * cpus->nb_ports);
+    dpdk->tx_ring_sz = malloc(sizeof(*(dpdk->tx_ring_sz)) * cpus->nb_ports);
+    dpdk->tx_done_cleanup = malloc(sizeof(*(dpdk->tx_done_cleanup)) * cpus->nb_ports);
+    if (!dpdk->nb_tx_queues || !dpdk->tx_ring_sz || !dpdk->tx_done_cleanup)
+        return (ENOMEM);
+
+    for (i = 0; (unsigned)i < cpus->nb_ports; i++) {
+        /*
+          the port must be on the numacore found for it from sysfs, whose
+          mempools and tx lcores were chosen for it (-1: not bound to one)
+        */
         numa = rte_eth_dev_socket_id(i);
-        if (numa != cpus->numacore) {
-            fprintf(stderr, "port %i is not on the good numa id (%i).\n", i, numa);
+        if (numa >= 0 && numa != cpus->port_numa[i]) {
+            fprintf(stderr, "port %i is on numa id %i, not %i.\n", i, numa,
+                    cpus->port_numa[i]);
             return (1);
         }
         /* init ports */
-        if (dpdk_init_port(cpus, i))
+        if (dpdk_init_port(opts, cpus, dpdk, i, 1))
             return (1);
         printf("-> NIC port %i ready.\n", i);
     }
     return (0);
 }
 
+/*
+  Stop the ports and configure them again with the given options. The mbufs
+  left in their tx queues are released.
+*/
+int restart_dpdk_ports(const struct cmd_opts* opts, struct cpus_bindings* cpus,
+                       struct dpdk_ctx* dpdk, const int verbose)
+{
+    int i, ret;
+
+    if (!opts || !cpus || !dpdk)
+        return (EINVAL);
+
+    for (i = 0; (unsigned)i < cpus->nb_ports; i++) {
+#if API_OLDEST_THAN(20, 11)
+        rte_eth_dev_stop(i);
+#else /* if DPDK >= 20.11 */
+        ret = rte_eth_dev_stop(i);
+        if (ret) {
+            fprintf(stderr, "DPDK: RTE ETH Ethernet device stop failed: %s\n",
+                    strerror(-ret));
+            return (ret);
+        }
+#endif
+        ret = dpdk_init_port(opts, cpus, dpdk, i, verbose);
+        if (ret)
+            return (ret);
+    }
+    return (0);
+}
+
 double timespec_diff_to_double(const struct timespec start, const struct timespec end)
 {
     struct timespec diff;
@@ -277,23 +606,469 @@ double timespec_diff_to_double(const struct timespec start, const struct timespe
     return (duration);
 }
 
+#ifdef TX_HISTOGRAMS
+/* histogram bucket of a value, see HIST_SUB_BITS */
+static inline unsigned int hist_bucket(const uint64_t val)
+{
+    unsigned int    exp;
+
+    if (val < (2 << HIST_SUB_BITS))
+        return (val);
+    exp = 63 - __builtin_clzll(val);
+    return (((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+            ((val >> (exp - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1)));
+}
+
+static inline void hist_add(struct hist* h, const uint64_t val)
+{
+    h->count[hist_bucket(val)]++;
+    if (unlikely(val > h->max))
+        h->max = val;
+    return ;
+}
+#endif /* TX_HISTOGRAMS */
+
+/*
+  rte_eth_tx_burst on a queue of the task. With --tx-histograms, the cycles
+  spent in the call and the number of pkts it took are recorded. Without
+  TX_HISTOGRAMS, it's the bare call.
+*/
+static inline unsigned int tx_burst(struct thread_ctx* ctx, const unsigned int queue,
+                                    struct rte_mbuf** mbuf, const unsigned int nb)
+{
+#ifdef TX_HISTOGRAMS
+    uint64_t        start;
+    unsigned int    nb_sent;
+
+    if (ctx->hists) {
+        start = rte_rdtsc();
+        nb_sent = rte_eth_tx_burst(ctx->tx_port_id, ctx->tx_queue_base + queue, mbuf, nb);
+        hist_add(&(ctx->hists->cycles), rte_rdtsc() - start);
+        hist_add(&(ctx->hists->pkts), nb_sent);
+        return (nb_sent);
+    }
+#endif /* TX_HISTOGRAMS */
+    return (rte_eth_tx_burst(ctx->tx_port_id, ctx->tx_queue_base + queue, mbuf, nb));
+}
+
+/*
+  Send a batch of mbufs over the tx queues. While the NIC doesn't take them
+  all, spin on the next queues for at most retry_tsc cycles, then drop the
+  remainder. Returns the number of dropped (and freed) mbufs.
+*/
+static inline int tx_burst_retry(struct thread_ctx* ctx, struct rte_mbuf** mbuf,
+                                 const int to_sent)
+{
+    unsigned int    queue, blocked_queue = 0;
+    uint64_t        now;
+    int             nb_sent, total_sent, i;
+    int             nb_drop = 0;
+
+    for (total_sent = 0; ; rte_pause()) {
+        queue = ctx->tx_queue++ % ctx->nb_tx_queues;
+        nb_sent = tx_burst(ctx, queue, &(mbuf[total_sent]), to_sent - total_sent);
+        total_sent += nb_sent;
+        if (likely(total_sent == to_sent))
+            break;
+        /* the blocked time is accounted to the first full queue */
+        now = rte_rdtsc();
+        if (!ctx->blocked_since) {
+            ctx->blocked_since = now;
+            blocked_queue = queue;
+        } else if (now - ctx->blocked_since >= ctx->retry_tsc)
+            break;
+    }
+    ctx->live->pkts += total_sent;
+    if (unlikely(ctx->blocked_since)) {
+        ctx->blocked_tsc[blocked_queue] += rte_rdtsc() - ctx->blocked_since;
+        ctx->blocked_since = 0;
+        ctx->live->full_queues++;
+    }
+    /* free unsuccessfully sent */
+    for (i = total_sent; i < to_sent; i++) {
+        nb_drop++;
+        ctx->total_drop_sz += mbuf[i]->pkt_len;
+        ctx->total_drop_wire_sz += WIRE_SZ(mbuf[i]->pkt_len);
+        rte_pktmbuf_free(mbuf[i]);
+    }
+    if (unlikely(nb_drop))
+        ctx->live->drops += nb_drop;
+    return (nb_drop);
+}
+
+/*
+  Lossless mode: give the mbufs to the current queue, without waiting. What
+  the queue can't take is sent again on the next call, on the same queue, so
+  that the packets order is kept. Returns the number of sent mbufs.
+*/
+static inline unsigned int tx_burst_lossless(struct thread_ctx* ctx,
+                                             struct rte_mbuf** mbuf,
+                                             const unsigned int nb)
+{
+    unsigned int    queue, nb_sent;
+
+    queue = ctx->tx_queue % ctx->nb_tx_queues;
+    nb_sent = tx_burst(ctx, queue, mbuf, nb);
+    ctx->live->pkts += nb_sent;
+    if (unlikely(nb_sent < nb)) {
+        if (!ctx->blocked_since) {
+            ctx->blocked_since = rte_rdtsc();
+            ctx->live->full_queues++;
+        }
+#if API_AT_LEAST_AS_RECENT_AS(19, 11)
+        /* don't wait for the PMD tx_free_thresh to reclaim the descriptors */
+        if (ctx->tx_cleanup)
+            rte_eth_tx_done_cleanup(ctx->tx_port_id, ctx->tx_queue_base + queue, 0);
+#endif /* API_AT_LEAST_AS_RECENT_AS(19, 11) */
+        return (nb_sent);
+    }
+    if (unlikely(ctx->blocked_since)) {
+        ctx->blocked_tsc[queue] += rte_rdtsc() - ctx->blocked_since;
+        ctx->blocked_since = 0;
+    }
+    ctx->tx_queue++;
+    return (nb_sent);
+}
+
+/*
+  Token bucket pacing: tell if the given burst can be sent without going
+  over --maxbitrate/--maxpps. The bucket only holds the credit of one burst,
+  so being late never results in a longer burst on the wire.
+*/
+static inline int tx_pace(struct thread_ctx* ctx, struct rte_mbuf** mbuf,
+                          const int nb)
+{
+    uint64_t    now, cost;
+    double      sz;
+    int         i;
+
+    for (i = 0, sz = 0; i < nb; i++)
+        sz += mbuf[i]->pkt_len;
+    cost = max(sz * ctx->tsc_per_byte, nb * ctx->tsc_per_pkt);
+
+    now = rte_rdtsc();
+    if (ctx->next_tsc + cost < now)
+        ctx->next_tsc = now - cost;
+    if (now < ctx->next_tsc)
+        return (0);
+    ctx->next_tsc += cost;
+    return (1);
+}
+
+/*
+  The tx lcores interleave the bursts of their tasks (ports, or slices of a
+  port): the tx_*_step functions send the next burst of a task if it can go
+  now, and return 0 once the task is done. They never wait, so that a port
+  doesn't delay the others of its lcore.
+*/
+
+/* streaming mode: send the mbufs of the ring until the reader is done */
+static int tx_stream_step(struct thread_ctx* ctx)
+{
+    unsigned int    nb, i;
+
+    if (!ctx->burst_len) {
+        nb = rte_ring_dequeue_burst(ctx->ring, (void**)ctx->burst, ctx->burst_sz, NULL);
+        if (unlikely(!nb)) {
+            if (!ctx->stream->done) {
+                /* the reader didn't keep up */
+                if (!ctx->empty) {
+                    ctx->nb_underruns++;
+                    ctx->live->underruns++;
+                }
+                ctx->empty = 1;
+                return (1);
+            }
+            /* the last batch may have been enqueued just before done was set */
+            nb = rte_ring_dequeue_burst(ctx->ring, (void**)ctx->burst, ctx->burst_sz, NULL);
+            if (!nb)
+                return (0);
+        }
+        ctx->empty = 0;
+        ctx->burst_len = nb;
+        ctx->total_pkt += nb;
+        for (i = 0; i < nb; i++) {
+            ctx->total_pkt_sz += ctx->burst[i]->pkt_len;
+            ctx->total_wire_sz += WIRE_SZ(ctx->burst[i]->pkt_len);
+        }
+    }
+    if (!ctx->nb_pending) {
+        if (ctx->paced && !tx_pace(ctx, ctx->burst, ctx->burst_len))
+            return (1);
+        ctx->nb_pending = ctx->burst_len;
+    }
+    if (ctx->lossless) {
+        ctx->nb_pending -= tx_burst_lossless(ctx, ctx->burst + ctx->burst_len
+                                             - ctx->nb_pending, ctx->nb_pending);
+        if (ctx->nb_pending)
+            return (1);
+    } else
+        ctx->total_drop += tx_burst_retry(ctx, ctx->burst, ctx->burst_len);
+    ctx->burst_len = ctx->nb_pending = 0;
+    return (1);
+}
+
+/*
+  Give rearm_runs more runs to the mbufs of the cache, before their refcnt
+  drops to 0. The PMD frees of the slice are done by this lcore only, so
+  there is no race with them.
+*/
+static void tx_rearm(struct thread_ctx* ctx)
+{
+    struct rte_mbuf*    seg;
+    unsigned int        nb, i;
+
+    nb = ctx->rearm_runs;
+    if (!ctx->forever)
+        nb = min(nb, ctx->run_cpt - ctx->armed_runs);
+    for (i = 0; i < ctx->nb_pkt; i++)
+        for (seg = ctx->mbufs[i]; seg; seg = seg->next)
+            rte_mbuf_refcnt_update(seg, nb);
+    ctx->armed_runs += nb;
+    return ;
+}
+
+/*
+  --rewrite: the pkts of the burst can be rewritten once their previous run
+  is sent, that is when the NIC released all their refcnts but the armed
+  runs.
+*/
+static inline int tx_rewrite_ready(const struct thread_ctx* ctx,
+                                   struct rte_mbuf** mbuf, const unsigned int nb)
+{
+    unsigned int    i;
+
+    for (i = 0; i < nb; i++)
+        if (rte_mbuf_refcnt_read(mbuf[i]) > ctx->armed_runs)
+            return (0);
+    return (1);
+}
+
+/*
+  --rewrite: most PMDs only reclaim the sent descriptors in tx_burst, once
+  the free ones go below their free threshold. When the whole cache fits in
+  the tx queues, the refcnts waited for would never be released: ask the PMD
+  to reclaim all the sent pkts of the queues of the task.
+*/
+static void tx_reclaim(struct thread_ctx* ctx)
+{
+    int q;
+
+    for (q = 0; q < ctx->nb_tx_queues; q++) {
+#if API_AT_LEAST_AS_RECENT_AS(19, 11)
+        if (rte_eth_tx_done_cleanup(ctx->tx_port_id, ctx->tx_queue_base + q, 0) >= 0)
+            continue;
+#endif /* API_AT_LEAST_AS_RECENT_AS(19, 11) */
+        rte_eth_tx_burst(ctx->tx_port_id, ctx->tx_queue_base + q, NULL, 0);
+    }
+    return ;
+}
+
+/* the whole cache was sent: start the next run */
+static int tx_end_of_run(struct thread_ctx* ctx)
+{
+#ifdef DEBUG
+    if (unlikely(ctx->run_drop))
+        printf("[port %i]: on loop %lu: sent %u pkts (%lu were dropped).\n",
+               ctx->tx_port_id, ctx->runs_done, ctx->nb_pkt, ctx->run_drop);
+#endif /* DEBUG */
+    ctx->runs_done++;
+    if (ctx->rw_pkts)
+        rewrite_run_diff(ctx->rw_fields, ctx->rw_rand, ctx->runs_done, ctx->rw_diff);
+    ctx->total_pkt += ctx->nb_pkt;
+    ctx->total_pkt_sz += ctx->pcap_sz;
+    ctx->total_wire_sz += ctx->pcap_wire_sz;
+    ctx->total_drop += ctx->run_drop;
+    ctx->run_drop = 0;
+    ctx->index = 0;
+    /* hw timestamps: next run starts with the last packet of this one */
+    ctx->ts_shift = ctx->run_ticks;
+    ctx->armed_runs--;
+    if (!ctx->forever && !--ctx->run_cpt)
+        return (0);
+    if (unlikely(ctx->armed_runs <= ctx->arm_max - ctx->rearm_runs) &&
+        (ctx->forever || (unsigned int)ctx->run_cpt > ctx->armed_runs))
+        tx_rearm(ctx);
+    return (1);
+}
+
+/* --duration is over or replay interrupted: count the sent part of the run */
+static int tx_stop(struct thread_ctx* ctx)
+{
+    unsigned int    i;
+
+    ctx->total_pkt += ctx->index;
+    for (i = 0; i < ctx->index; i++) {
+        ctx->total_pkt_sz += ctx->mbufs[i]->pkt_len;
+        ctx->total_wire_sz += WIRE_SZ(ctx->mbufs[i]->pkt_len);
+    }
+    ctx->total_drop += ctx->run_drop;
+    return (0);
+}
+
+/*
+  Send the next burst of the cache. In normalspeed mode, each packet is sent
+  when its pcap timestamp is reached: packets due in the next window_tsc
+  cycles are sent in the same burst, as waiting for each of them would cost
+  more than the gap itself.
+*/
+static int tx_cache_step(struct thread_ctx* ctx)
+{
+    struct rte_mbuf**   mbuf = ctx->mbufs + ctx->index;
+    unsigned int        to_sent;
+    uint64_t            now, deadline, next_tsc = 0;
+
+    if (!ctx->nb_pending) {
+        to_sent = min((unsigned int)ctx->burst_sz, ctx->nb_pkt - ctx->index);
+        if (ctx->rw_pkts && ctx->runs_done && !tx_rewrite_ready(ctx, mbuf, to_sent)) {
+            tx_reclaim(ctx);
+            return (1);
+        }
+        if (ctx->ipg) {
+            now = rte_rdtsc();
+            if (now < ctx->timed_tsc)
+                return (1);
+            for (to_sent = 1, deadline = ctx->timed_tsc;
+                 ctx->index + to_sent < ctx->nb_pkt && to_sent < (unsigned int)ctx->burst_sz &&
+                     deadline + ctx->ipg[ctx->index + to_sent] <= now + ctx->window_tsc;
+                 to_sent++)
+                deadline += ctx->ipg[ctx->index + to_sent];
+            /* deadlines are absolute: being late is caught up on the next pkts */
+            next_tsc = deadline + ctx->ipg[(ctx->index + to_sent) % ctx->nb_pkt];
+        }
+        if (ctx->paced && !tx_pace(ctx, mbuf, to_sent))
+            return (1);
+        /* the burst is accepted: the next one is due after its last pkt */
+        if (ctx->ipg)
+            ctx->timed_tsc = next_tsc;
+        if (ctx->rw_pkts && ctx->runs_done)
+            rewrite_pkts(mbuf, ctx->rw_pkts + ctx->index, to_sent, ctx->rw_diff);
+        ctx->nb_pending = to_sent;
+    }
+    if (ctx->lossless) {
+        to_sent = tx_burst_lossless(ctx, mbuf, ctx->nb_pending);
+        ctx->index += to_sent;
+        ctx->nb_pending -= to_sent;
+        if (ctx->nb_pending)
+            return (1);
+    } else {
+        ctx->run_drop += tx_burst_retry(ctx, mbuf, ctx->nb_pending);
+        ctx->index += ctx->nb_pending;
+        ctx->nb_pending = 0;
+    }
+    if (ctx->index == ctx->nb_pkt)
+        return (tx_end_of_run(ctx));
+    return (1);
+}
+
+#if API_AT_LEAST_AS_RECENT_AS(20, 11)
+/*
+  normalspeed mode with the tx timestamp offload: the NIC holds each packet
+  until its timestamp, so the queues are just kept full. Nothing is dropped:
+  a full queue only means that the NIC is waiting.
+*/
+static int tx_hw_step(struct thread_ctx* ctx)
+{
+    struct rte_mbuf**   mbuf = ctx->mbufs + ctx->index;
+    unsigned int        nb_sent, i;
+
+    if (!ctx->nb_pending) {
+        ctx->nb_pending = min((unsigned int)ctx->burst_sz, ctx->nb_pkt - ctx->index);
+        if (ctx->rw_pkts && ctx->runs_done) {
+            if (!tx_rewrite_ready(ctx, mbuf, ctx->nb_pending)) {
+                tx_reclaim(ctx);
+                ctx->nb_pending = 0;
+                return (1);
+            }
+            rewrite_pkts(mbuf, ctx->rw_pkts + ctx->index, ctx->nb_pending, ctx->rw_diff);
+        }
+        /* the timestamps are relative to the previous run start */
+        for (i = 0; i < ctx->nb_pending; i++)
+            *RTE_MBUF_DYNFIELD(mbuf[i], ctx->ts_offset, uint64_t*) += ctx->ts_shift;
+        ctx->last_ts = *RTE_MBUF_DYNFIELD(mbuf[ctx->nb_pending - 1], ctx->ts_offset,
+                                          uint64_t*);
+    }
+    nb_sent = tx_burst_lossless(ctx, mbuf, ctx->nb_pending);
+    ctx->index += nb_sent;
+    ctx->nb_pending -= nb_sent;
+    if (ctx->nb_pending)
+        return (1);
+    if (ctx->index == ctx->nb_pkt)
+        return (tx_end_of_run(ctx));
+    return (1);
+}
+
+/* wait for the NIC to send the last packet, so that the duration is right */
+static void tx_hw_wait(struct thread_ctx* ctx)
+{
+    uint64_t    clk;
+
+    while (!rte_eth_read_clock(ctx->tx_port_id, &clk) && clk < ctx->last_ts)
+        rte_pause();
+    return ;
+}
+#endif /* API_AT_LEAST_AS_RECENT_AS(20, 11) */
+
+static inline int tx_step(struct thread_ctx* ctx)
+{
+    if (ctx->ring)
+        return (tx_stream_step(ctx));
+    if (unlikely(*ctx->quit || (ctx->end_tsc && rte_rdtsc() >= ctx->end_tsc)))
+        return (tx_stop(ctx));
+#if API_AT_LEAST_AS_RECENT_AS(20, 11)
+    if (ctx->tx_ts)
+        return (tx_hw_step(ctx));
+#endif /* API_AT_LEAST_AS_RECENT_AS(20, 11) */
+    return (tx_cache_step(ctx));
+}
+
+static void tx_task_init(struct thread_ctx* ctx)
+{
+    ctx->tx_queue = 0;
+    ctx->total_drop = ctx->total_drop_sz = ctx->total_drop_wire_sz = 0;
+    ctx->retry_tsc = rte_get_tsc_hz() / 1000000 * TX_RETRY_US;
+    ctx->run_cpt = ctx->nbruns;
+    ctx->next_tsc = ctx->timed_tsc = rte_rdtsc();
+    if (ctx->ring)
+        return ;
+    ctx->mbufs = ctx->pcap_cache->mbufs + ctx->first_pkt;
+    if (ctx->replay_tsc)
+        ctx->end_tsc = ctx->next_tsc + ctx->replay_tsc;
+#if API_AT_LEAST_AS_RECENT_AS(20, 11)
+    /* first run starts a bit later, the time to fill the queues */
+    if (ctx->tx_ts && !rte_eth_read_clock(ctx->tx_port_id, &(ctx->ts_shift)))
+        ctx->ts_shift += TX_TS_LEAD_NS * ctx->ts_ratio;
+#endif /* API_AT_LEAST_AS_RECENT_AS(20, 11) */
+    return ;
+}
+
+/* get the duration of a task, from the lcore start */
+static int tx_task_end(struct thread_ctx* ctx, const struct timespec* start)
+{
+    struct timespec end;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &end)) {
+        fprintf(stderr, "clock_gettime failed on finish for port %i: %s\n",
+                ctx->tx_port_id, strerror(errno));
+        return (errno);
+    }
+    ctx->duration = timespec_diff_to_double(*start, end);
+    return (0);
+}
+
 int tx_thread(void* thread_ctx)
 {
     struct thread_ctx*  ctx;
-    struct rte_mbuf**   mbuf;
-    struct timespec     start, end;
-    unsigned int        tx_queue;
-    int                 ret, thread_id, index, i, run_cpt, retry_tx;
-    int                 nb_sent, to_sent, total_to_sent, total_sent;
-    int                 nb_drop;
+    struct thread_ctx*  task;
+    struct timespec     start;
+    int                 ret, thread_id, nb_running;
 
     if (!thread_ctx)
         return (EINVAL);
 
-    /* retrieve thread context */
+    /* retrieve thread context, and its tasks */
     ctx = (struct thread_ctx*)thread_ctx;
     thread_id = ctx->tx_port_id;
-    mbuf = ctx->pcap_cache->mbufs;
 #ifdef DEBUG
     printf("Starting thread %i.\n", thread_id);
 #endif
@@ -314,57 +1089,135 @@ int tx_thread(void* thread_ctx)
         return (errno);
     }
 
-    /* iterate on each wanted runs */
-    for (run_cpt = ctx->nbruns, tx_queue = ctx->total_drop = ctx->total_drop_sz = 0;
-         run_cpt;
-         ctx->total_drop += nb_drop, run_cpt--) {
-        /* iterate on pkts for every batch of BURST_SZ number of packets */
-        for (total_to_sent = ctx->nb_pkt, nb_drop = 0, to_sent = min(BURST_SZ, total_to_sent);
-             to_sent;
-             total_to_sent -= to_sent, to_sent = min(BURST_SZ, total_to_sent)) {
-            /* calculate the mbuf index for the current batch */
-            index = ctx->nb_pkt - total_to_sent;
-
-            /* send the burst batch, and retry NB_RETRY_TX times if we */
-            /* didn't success to sent all the wanted batch */
-            for (total_sent = 0, retry_tx = NB_RETRY_TX;
-                 total_sent < to_sent && retry_tx;
-                 total_sent += nb_sent, retry_tx--) {
-                nb_sent = rte_eth_tx_burst(ctx->tx_port_id,
-                                           (tx_queue++ % NB_TX_QUEUES),
-                                           &(mbuf[index + total_sent]),
-                                           to_sent - total_sent);
-                if (retry_tx != NB_RETRY_TX &&
-                    tx_queue % NB_TX_QUEUES == 0)
-                    usleep(100);
-            }
-            /* free unseccessfully sent  */
-            if (unlikely(!retry_tx))
-                for (i = total_sent; i < to_sent; i++) {
-                    nb_drop++;
-                    ctx->total_drop_sz += mbuf[index + i]->pkt_len;
-                    rte_pktmbuf_free(mbuf[index + i]);
-                }
+    for (task = ctx, nb_running = 0; task; task = task->next, nb_running++)
+        tx_task_init(task);
+    /* send a burst of each running task in turn */
+    while (nb_running)
+        for (task = ctx; task; task = task->next) {
+            if (task->finished || tx_step(task))
+                continue;
+            task->finished = 1;
+            nb_running--;
+            if (task->tx_ts)
+                continue;
+            ret = tx_task_end(task, &start);
+            if (ret)
+                return (ret);
         }
+
+#if API_AT_LEAST_AS_RECENT_AS(20, 11)
+    for (task = ctx; task; task = task->next) {
+        if (!task->tx_ts)
+            continue;
+        tx_hw_wait(task);
+        ret = tx_task_end(task, &start);
+        if (ret)
+            return (ret);
+    }
+#endif /* API_AT_LEAST_AS_RECENT_AS(20, 11) */
 #ifdef DEBUG
-        if (unlikely(nb_drop))
-            printf("[thread %i]: on loop %i: sent %i pkts (%i were dropped).\n",
-                   thread_id, ctx->nbruns - run_cpt, ctx->nb_pkt, nb_drop);
+    printf("Exiting thread %i properly.\n", thread_id);
 #endif /* DEBUG */
+    return (0);
+}
+
+/*
+  Convert the wanted rates into tsc cycles per byte/packet, and shorten the
+  bursts so that one of them lasts at most PACING_WINDOW_NS on the wire.
+*/
+static void init_pacing(const struct cmd_opts* opts, const struct pcap_ctx* pcap,
+                        const struct dpdk_ctx* dpdk, struct thread_ctx* ctx)
+{
+    double  tsc_hz, avg_pkt_sz, pkt_cost;
+
+    ctx->burst_sz = opts->burst_sz;
+    if (!opts->maxbitrate && !opts->maxpps)
+        return ;
+
+    /* the rates are shared by the cores of a port */
+    ctx->paced = 1;
+    tsc_hz = rte_get_tsc_hz();
+    if (opts->maxbitrate)
+        ctx->tsc_per_byte = tsc_hz * 8 * opts->cores_per_port
+            / (opts->maxbitrate * 1000 * 1000);
+    if (opts->maxpps)
+        ctx->tsc_per_pkt = tsc_hz * opts->cores_per_port / opts->maxpps;
+
+    /* the average packet size is unknown when streaming: use the biggest */
+    if (pcap->nb_pkts)
+        avg_pkt_sz = (double)dpdk->pcap_sz / pcap->nb_pkts;
+    else
+        avg_pkt_sz = pcap->max_pkt_sz;
+    pkt_cost = max(avg_pkt_sz * ctx->tsc_per_byte, ctx->tsc_per_pkt);
+    if (pkt_cost > 0)
+        ctx->burst_sz = max(1, min((int)opts->burst_sz, (int)(tsc_hz * PACING_WINDOW_NS
+                                                   / 1000000000 / pkt_cost)));
+    return ;
+}
+
+/* print the achieved rates of a port against the wanted ones */
+static void print_port_stats(const struct cmd_opts* opts, const unsigned int port,
+                             const int print_rates, const double duration,
+                             const uint64_t pkt_sent, const uint64_t pkt_sent_sz,
+                             const uint64_t pkt_sent_wire_sz, const double expected_duration)
+{
+    double          pps, rate, wire_rate;
+    unsigned int    link_speed;
+
+    pps = pkt_sent / duration;
+    wire_rate = (double)pkt_sent_wire_sz * 8 / duration / 1000 / 1000 / 1000;
+    if (print_rates)
+        printf("[port %02u]  : %f Gbit/s (%f on the wire), %f pps on %f sec\n", port,
+               (double)pkt_sent_sz * 8 / duration / 1000 / 1000 / 1000, wire_rate,
+               pps, duration);
+    link_speed = get_link_speed(port);
+    if (link_speed)
+        printf("             %.3f%% of the %g Gbit/s line rate\n",
+               wire_rate * 1000 * 100 / link_speed, (double)link_speed / 1000);
+    /* achieved rates against the wanted ones */
+    if (opts->maxbitrate) {
+        rate = pkt_sent_sz * 8 / duration / 1000 / 1000;
+        printf("             %.3f Mbit/s for %.3f wanted (pacing error: %+.3f%%)\n",
+               rate, opts->maxbitrate, (rate - opts->maxbitrate) * 100 / opts->maxbitrate);
     }
+    if (opts->maxpps)
+        printf("             %.3f pps for %.3f wanted (pacing error: %+.3f%%)\n",
+               pps, opts->maxpps, (pps - opts->maxpps) * 100 / opts->maxpps);
+    if (expected_duration)
+        printf("             %f sec for %f expected from the pcap timestamps\n",
+               duration, expected_duration);
+    return ;
+}
 
-    /* get the ends time and calculate the duration */
-    ret = clock_gettime(CLOCK_MONOTONIC, &end);
-    if (ret) {
-        fprintf(stderr, "clock_gettime failed on finish for thread %i: %s\n",
-                thread_id, strerror(errno));
-        return (errno);
+/*
+  Print the time spent on full tx queues: spread over all the queues, the NIC
+  (or the link) is the bottleneck. Low, with rates under the wanted ones, the
+  cpu is.
+*/
+static void print_blocked_stats(const struct thread_ctx* ctx)
+{
+    uint64_t        blocked = 0;
+    double          tsc_hz;
+    int             q, worst = 0;
+
+    for (q = 0; q < ctx->nb_tx_queues; q++) {
+        blocked += ctx->blocked_tsc[q];
+        if (ctx->blocked_tsc[q] > ctx->blocked_tsc[worst])
+            worst = q;
     }
-    ctx->duration = timespec_diff_to_double(start, end);
+    if (!blocked || !ctx->duration)
+        return ;
+    tsc_hz = rte_get_tsc_hz();
+    printf("             blocked on full tx queues %.3f%% of the time"
+           " (queue %i: %.3f%%)\n", blocked / tsc_hz * 100 / ctx->duration,
+           ctx->tx_queue_base + worst, ctx->blocked_tsc[worst] / tsc_hz * 100 / ctx->duration);
 #ifdef DEBUG
-    printf("Exiting thread %i properly.\n", thread_id);
+    for (q = 0; q < ctx->nb_tx_queues; q++)
+        if (ctx->blocked_tsc[q])
+            printf("               queue %i: %lu cycles\n", ctx->tx_queue_base + q,
+                   ctx->blocked_tsc[q]);
 #endif /* DEBUG */
-    return (0);
+    return ;
 }
 
 int process_result_stats(const struct cpus_bindings* cpus,
@@ -372,43 +1225,250 @@ int process_result_stats(const struct cpus_bindings* cpus,
                          const struct cmd_opts* opts,
                          const struct thread_ctx* ctx)
 {
-    double              pps, bitrate;
-    double              total_pps, total_bitrate;
-    unsigned long int   total_pkt_sent, total_pkt_sent_sz;
-    unsigned int        i, total_drop, total_pkt;
+    double      pps, bitrate, wire_bitrate, port_duration;
+    double      total_pps, total_bitrate, total_wire_bitrate;
+    uint64_t    total_pkt_sent, total_pkt_sent_sz, total_pkt_sent_wire_sz, total_underruns;
+    uint64_t    port_pkt_sent, port_pkt_sent_sz, port_pkt_sent_wire_sz;
+    uint64_t    total_drop, total_pkt;
+    unsigned int i;
 
     if (!cpus || !dpdk || !opts || !ctx)
         return (EINVAL);
 
-    total_pps = total_bitrate = 0;
-    total_drop = 0;
+    total_pps = total_bitrate = total_wire_bitrate = 0;
+    total_drop = total_pkt = total_underruns = 0;
+    port_pkt_sent = port_pkt_sent_sz = port_pkt_sent_wire_sz = 0;
+    port_duration = 0;
     puts("RESULTS :");
-    for (i = 0; i < cpus->nb_needed_cpus; i++) {
-        total_pkt_sent = (ctx[i].nb_pkt * opts->nbruns) - ctx[i].total_drop;
-        total_pkt_sent_sz = (dpdk->pcap_sz * opts->nbruns) - ctx[i].total_drop_sz;
+    for (i = 0; i < cpus->nb_tasks; i++) {
+        total_pkt_sent = ctx[i].total_pkt - ctx[i].total_drop;
+        total_pkt_sent_sz = ctx[i].total_pkt_sz - ctx[i].total_drop_sz;
+        total_pkt_sent_wire_sz = ctx[i].total_wire_sz - ctx[i].total_drop_wire_sz;
         pps = total_pkt_sent / ctx[i].duration;
-        bitrate = total_pkt_sent_sz / ctx[i].duration
-            * 8 /* Bytes to bits */
-            / 1024 /* bits to Kbits */
-            / 1024 /* Kbits to Mbits */
-            / 1024; /* Mbits to Gbits */
+        /* in decimal units, as the link speeds */
+        bitrate = total_pkt_sent_sz / ctx[i].duration * 8 / 1000 / 1000 / 1000;
+        wire_bitrate = total_pkt_sent_wire_sz / ctx[i].duration * 8 / 1000 / 1000 / 1000;
         total_bitrate += bitrate;
+        total_wire_bitrate += wire_bitrate;
         total_pps += pps;
         total_drop += ctx[i].total_drop;
-        printf("[thread %02u]: %f Gbit/s, %f pps on %f sec (%u pkts dropped)\n",
-               i, bitrate, pps, ctx[i].duration, ctx[i].total_drop);
+        total_pkt += ctx[i].total_pkt;
+        total_underruns += ctx[i].nb_underruns;
+        printf("[thread %02u]: %f Gbit/s (%f on the wire), %f pps on %f sec"
+               " (%lu pkts dropped, %.1f cycles/pkt)\n", i, bitrate, wire_bitrate, pps,
+               ctx[i].duration, ctx[i].total_drop, get_cycles_per_pkt(cpus, ctx, i));
+        print_blocked_stats(&(ctx[i]));
+        print_tx_hists(ctx[i].hists);
+
+        /* the cores of a port follow each other: sum them on the last one */
+        port_pkt_sent += total_pkt_sent;
+        port_pkt_sent_sz += total_pkt_sent_sz;
+        port_pkt_sent_wire_sz += total_pkt_sent_wire_sz;
+        port_duration = max(port_duration, ctx[i].duration);
+        if ((i + 1) % cpus->cores_per_port)
+            continue;
+        print_port_stats(opts, ctx[i].tx_port_id, cpus->cores_per_port > 1,
+                         port_duration, port_pkt_sent, port_pkt_sent_sz,
+                         port_pkt_sent_wire_sz, ctx[i].expected_duration);
+        port_pkt_sent = port_pkt_sent_sz = port_pkt_sent_wire_sz = 0;
+        port_duration = 0;
     }
     puts("-----");
-    printf("TOTAL        : %.3f Gbit/s. %.3f pps.\n", total_bitrate, total_pps);
-    total_pkt = ctx[0].nb_pkt * opts->nbruns * cpus->nb_needed_cpus;
-    printf("Total dropped: %u/%u packets (%f%%)\n", total_drop, total_pkt,
-           (double)(total_drop * 100) / (double)(total_pkt));
+    printf("TOTAL        : %.3f Gbit/s (%.3f on the wire). %.3f pps.\n", total_bitrate,
+           total_wire_bitrate, total_pps);
+    printf("Total dropped: %lu/%lu packets (%f%%)\n", total_drop, total_pkt,
+           total_pkt ? (double)total_drop * 100 / total_pkt : 0);
+    if (dpdk->stream.rings) {
+        printf("Stream reader: %lu pkts read at %.3f Gbit/s (%lu waits on full rings,"
+               " %lu pkts skipped)\n",
+               dpdk->stream.nb_pkts,
+               dpdk->stream.read_sz / dpdk->stream.duration * 8 / 1000 / 1000 / 1000,
+               dpdk->stream.nb_stalls, dpdk->stream.nb_skipped);
+        if (total_underruns)
+            printf("The disk didn't keep up: tx threads found their ring empty"
+                   " %lu times.\n", total_underruns);
+        else
+            puts("The disk kept up: tx threads never found their ring empty.");
+    }
+    return (write_results(opts, cpus, ctx));
+}
+
+/* create the contexts of the tasks, one per port or slice of a port */
+struct thread_ctx* init_tx_tasks(const struct cmd_opts* opts,
+                                 const struct cpus_bindings* cpus,
+                                 const struct dpdk_ctx* dpdk,
+                                 const struct pcap_ctx* pcap, sem_t* sem)
+{
+    struct thread_ctx*  ctx;
+    unsigned int        i, j, port, shard;
+
+    ctx = malloc(sizeof(*ctx) * cpus->nb_tasks);
+    if (!ctx)
+        return (NULL);
+    bzero(ctx, sizeof(*ctx) * cpus->nb_tasks);
+    for (i = 0; i < cpus->nb_tasks; i++) {
+        /* each core of a port owns a slice of its tx queues and of its cache */
+        port = i / cpus->cores_per_port;
+        shard = i % cpus->cores_per_port;
+        ctx[i].sem = sem;
+        ctx[i].tx_port_id = port;
+        ctx[i].nbruns = opts->nbruns;
+        ctx[i].forever = (opts->loop_forever || opts->duration);
+        ctx[i].replay_tsc = opts->duration * rte_get_tsc_hz();
+        ctx[i].armed_runs = dpdk->armed_runs;
+        ctx[i].quit = &quit;
+        ctx[i].live = &(dpdk->stats.tasks[i]);
+        bzero(ctx[i].live, sizeof(*(ctx[i].live)));
+        ctx[i].hists = (dpdk->stats.hists ? &(dpdk->stats.hists[i]) : NULL);
+        if (ctx[i].hists)
+            bzero(ctx[i].hists, sizeof(*(ctx[i].hists)));
+        ctx[i].nb_tx_queues = dpdk->nb_tx_queues[port] / cpus->cores_per_port;
+        ctx[i].tx_queue_base = shard * ctx[i].nb_tx_queues;
+        ctx[i].lossless = opts->lossless;
+        ctx[i].tx_cleanup = opts->tx_cleanup;
+        init_pacing(opts, pcap, dpdk, &(ctx[i]));
+        if (dpdk->stream.rings) {
+            ctx[i].ring = dpdk->stream.rings[port];
+            ctx[i].stream = &(dpdk->stream);
+            continue;
+        }
+        ctx[i].pcap_cache = &(dpdk->pcap_caches[port]);
+        ctx[i].first_pkt = (unsigned long)pcap->nb_pkts * shard / cpus->cores_per_port;
+        ctx[i].nb_pkt = (unsigned long)pcap->nb_pkts * (shard + 1) / cpus->cores_per_port
+            - ctx[i].first_pkt;
+        for (j = 0; j < ctx[i].nb_pkt; j++) {
+            ctx[i].pcap_sz += pcap->pkts[ctx[i].first_pkt + j].len;
+            ctx[i].pcap_wire_sz += WIRE_SZ(pcap->pkts[ctx[i].first_pkt + j].len);
+        }
+        if (pcap->rw_pkts) {
+            ctx[i].rw_pkts = pcap->rw_pkts + ctx[i].first_pkt;
+            ctx[i].rw_fields = opts->rewrite;
+            ctx[i].rw_rand = opts->rewrite_rand;
+        }
+        if (pcap->ipg) {
+            ctx[i].ipg = pcap->ipg + ctx[i].first_pkt;
+            ctx[i].window_tsc = rte_get_tsc_hz() / (1000000000 / PACING_WINDOW_NS);
+            if (!ctx[i].forever)
+                ctx[i].expected_duration = (double)pcap->ipg_sum * opts->nbruns
+                    / rte_get_tsc_hz();
+        }
+        if (dpdk->tx_ts) {
+            ctx[i].tx_ts = 1;
+            ctx[i].ts_offset = dpdk->ts_offset;
+            ctx[i].ts_ratio = dpdk->ts_ratio[port];
+            ctx[i].run_ticks = (double)pcap->ipg_sum * 1000000000 / rte_get_tsc_hz()
+                * dpdk->ts_ratio[port];
+        }
+    }
+    return (ctx);
+}
+
+/*
+  The refcnt of a cached mbuf is its armed runs plus its references in the
+  tx queues of its task, up to one per pass of the slice in them: a tiny
+  trace in big queues can be referenced thousands of times. The sends only
+  consume the armed runs, so only the re-arms can make it wrap: when a task
+  re-arms, bound its armed runs so that the 16 bits refcnt never wraps,
+  lowering the refcnt armed by the caching if needed.
+*/
+int arm_tx_tasks(const struct cpus_bindings* cpus, const struct dpdk_ctx* dpdk,
+                 struct thread_ctx* ctx)
+{
+    struct rte_mbuf*    seg;
+    unsigned int        i, j, port, in_queues;
+    int                 diff;
+
+    if (!cpus || !dpdk || !ctx)
+        return (EINVAL);
+
+    for (i = 0; i < cpus->nb_tasks; i++) {
+        ctx[i].arm_max = MBUF_REFCNT_ARM;
+        ctx[i].rearm_runs = MBUF_REFCNT_REARM;
+        if (!ctx[i].nb_pkt)
+            continue;
+        port = ctx[i].tx_port_id;
+        /* the refcnt armed by the caching covers all the runs: no re-arm */
+        if (!ctx[i].forever && (unsigned int)ctx[i].nbruns <= ctx[i].armed_runs)
+            continue;
+        in_queues = dpdk->tx_ring_sz[port] / cpus->cores_per_port / ctx[i].nb_pkt + 1;
+        if (in_queues > UINT16_MAX - 2) {
+            fprintf(stderr, "port %u: the tx queues can hold more references to the %u pkts"
+                    " of a tx core than a mbuf refcnt: use less --tx-queues or --tx-desc,"
+                    " or --nbruns %u at most.\n", port, ctx[i].nb_pkt, MBUF_REFCNT_ARM);
+            return (EINVAL);
+        }
+        ctx[i].arm_max = min(MBUF_REFCNT_ARM, UINT16_MAX - in_queues);
+        ctx[i].rearm_runs = min(MBUF_REFCNT_REARM, ctx[i].arm_max / 2);
+        if (ctx[i].armed_runs <= ctx[i].arm_max)
+            continue;
+        /* nothing is in the queues yet */
+        diff = ctx[i].armed_runs - ctx[i].arm_max;
+        for (j = 0; j < ctx[i].nb_pkt; j++)
+            for (seg = ctx[i].pcap_cache->mbufs[ctx[i].first_pkt + j]; seg; seg = seg->next)
+                rte_mbuf_refcnt_update(seg, -diff);
+        ctx[i].armed_runs = ctx[i].arm_max;
+    }
+    return (0);
+}
+
+/*
+  --rewrite: without tx done cleanup, the PMD reclaims the sent pkts only
+  when its queues wrap, so the slice of a task must not fit in them.
+*/
+static int check_tx_reclaim(const struct cpus_bindings* cpus, const struct dpdk_ctx* dpdk,
+                            const struct thread_ctx* ctx)
+{
+    unsigned int    i, port, ring_sz;
+
+    for (i = 0; i < cpus->nb_tasks; i++) {
+        port = ctx[i].tx_port_id;
+        if (!ctx[i].rw_pkts || dpdk->tx_done_cleanup[port])
+            continue;
+        ring_sz = dpdk->tx_ring_sz[port] / cpus->cores_per_port;
+        if (ctx[i].nb_pkt <= ring_sz) {
+            fprintf(stderr, "port %u can't reclaim its sent pkts on demand: --rewrite needs"
+                    " more than %u pkts per tx core, the size of its tx queues (see"
+                    " --tx-queues and --tx-desc).\n", port, ring_sz);
+            return (EINVAL);
+        }
+    }
+    return (0);
+}
+
+/*
+  Launch the tx lcores, each one being given the list of its tasks. They
+  wait on the semaphore to start.
+*/
+int launch_tx_tasks(const struct cpus_bindings* cpus, struct thread_ctx* ctx)
+{
+    struct thread_ctx*  prev;
+    unsigned int        i, j;
+    int                 ret;
+
+    for (i = 0; i < cpus->nb_needed_cpus; i++) {
+        for (j = 0, prev = NULL; j < cpus->nb_tasks; j++) {
+            if (cpus->task_lcore[j] != i)
+                continue;
+            if (prev)
+                prev->next = &(ctx[j]);
+            prev = &(ctx[j]);
+        }
+    }
+    for (i = 0; i < cpus->nb_needed_cpus; i++) {
+        for (j = 0; cpus->task_lcore[j] != i; j++) ;
+        /* skip the fake master core, lcore 0 */
+        ret = rte_eal_remote_launch(tx_thread, &(ctx[j]), i + 1);
+        if (ret) {
+            fprintf(stderr, "rte_eal_remote_launch failed: %s\n", strerror(ret));
+            return (ret);
+        }
+    }
     return (0);
 }
 
 int start_tx_threads(const struct cmd_opts* opts,
                      const struct cpus_bindings* cpus,
-                     const struct dpdk_ctx* dpdk,
+                     struct dpdk_ctx* dpdk,
                      const struct pcap_ctx* pcap)
 {
     struct thread_ctx* ctx = NULL;
@@ -423,25 +1483,41 @@ int start_tx_threads(const struct cmd_opts* opts,
     }
 
     /* create threads contexts */
-    ctx = malloc(sizeof(*ctx) * cpus->nb_needed_cpus);
+    ctx = init_tx_tasks(opts, cpus, dpdk, pcap, &sem);
     if (!ctx)
         return (ENOMEM);
-    bzero(ctx, sizeof(*ctx) * cpus->nb_needed_cpus);
-    for (i = 0; i < cpus->nb_needed_cpus; i++) {
-        ctx[i].sem = &sem;
-        ctx[i].tx_port_id = i;
-        ctx[i].nbruns = opts->nbruns;
-        ctx[i].pcap_cache = &(dpdk->pcap_caches[i]);
-        ctx[i].nb_pkt = pcap->nb_pkts;
-        ctx[i].nb_tx_queues = NB_TX_QUEUES;
+    ret = arm_tx_tasks(cpus, dpdk, ctx);
+    if (!ret)
+        ret = check_tx_reclaim(cpus, dpdk, ctx);
+    if (ret) {
+        free(ctx);
+        return (ret);
+    }
+
+#if API_OLDEST_THAN(19, 11)
+    if (opts->tx_cleanup)
+        puts("-> --tx-cleanup needs DPDK 19.11 or newer: ignored.");
+#endif /* API_OLDEST_THAN(19, 11) */
+
+    /* endless replays are stopped with ^C, still giving the results */
+    dpdk->stream.quit = &quit;
+    dpdk->stream.stats = &(dpdk->stats);
+    if (opts->loop_forever || opts->duration) {
+        signal(SIGINT, quit_handler);
+        puts("-> Press ^C to stop the replay.");
     }
 
     /* launch threads, which will wait on the semaphore to start */
-    for (i = 0; i < cpus->nb_needed_cpus; i++) {
-        ret = rte_eal_remote_launch(tx_thread, &(ctx[i]),
-                                    cpus->cpus_to_use[i + 1]); /* skip fake master core */
+    ret = launch_tx_tasks(cpus, ctx);
+    if (ret) {
+        free(ctx);
+        return (ret);
+    }
+
+    /* fill the stream rings before starting */
+    if (dpdk->stream.rings) {
+        ret = stream_pcap(&(dpdk->stream), 1);
         if (ret) {
-            fprintf(stderr, "rte_eal_remote_launch failed: %s\n", strerror(ret));
             free(ctx);
             return (ret);
         }
@@ -465,9 +1541,22 @@ int start_tx_threads(const struct cmd_opts* opts,
             return (errno);
         }
     }
+    start_stats(&(dpdk->stats));
+
+    /* feed the stream rings until the end of the last run */
+    if (dpdk->stream.rings) {
+        if (opts->duration)
+            dpdk->stream.end_tsc = rte_rdtsc() + opts->duration * rte_get_tsc_hz();
+        ret = stream_pcap(&(dpdk->stream), 0);
+        if (ret)
+            fprintf(stderr, "stream_pcap failed: %s\n", strerror(ret));
+        /* let the tx threads end anyway */
+        dpdk->stream.done = 1;
+    }
 
     /* wait all threads */
-    rte_eal_mp_wait_lcore();
+    wait_tx_lcores(cpus, &(dpdk->stats));
+    signal(SIGINT, SIG_DFL);
 
     /* get results */
     ret = process_result_stats(cpus, dpdk, opts, ctx);
@@ -477,21 +1566,39 @@ int start_tx_threads(const struct cmd_opts* opts,
 
 void dpdk_cleanup(struct dpdk_ctx* dpdk, struct cpus_bindings* cpus)
 {
-    unsigned int i;
+    unsigned int i, c;
+    int          n;
+
+    /* first, the telemetry commands stop reading the context and the ports */
+    clean_stats(&(dpdk->stats));
 
     /* free caches */
     if (dpdk->pcap_caches) {
-        for (i = 0; i < cpus->nb_needed_cpus; i++)
+        for (i = 0; i < cpus->nb_ports; i++)
             free(dpdk->pcap_caches[i].mbufs);
         free(dpdk->pcap_caches);
     }
 
+    clean_stream(&(dpdk->stream));
+    free(dpdk->ts_ratio);
+    free(dpdk->nb_tx_queues);
+    free(dpdk->tx_ring_sz);
+    free(dpdk->tx_done_cleanup);
+
     /* close ethernet devices */
-    for (i = 0; i < cpus->nb_needed_cpus; i++)
+    for (i = 0; i < cpus->nb_ports; i++)
         rte_eth_dev_close(i);
 
-    /* free mempool */
-    if (dpdk->pktmbuf_pool)
-        rte_mempool_free(dpdk->pktmbuf_pool);
+    /* free mempools */
+    for (n = 0; n < MAX_NUMA_NODES; n++) {
+        if (dpdk->indirect_pools[n])
+            rte_mempool_free(dpdk->indirect_pools[n]);
+        if (dpdk->images[n])
+            rte_memzone_free(dpdk->images[n]);
+        free(dpdk->image_shinfos[n]);
+        for (c = 0; c < NB_MBUF_CLASSES; c++)
+            if (dpdk->pktmbuf_pools[n][c])
+                rte_mempool_free(dpdk->pktmbuf_pools[n][c]);
+    }
     return ;
 }
@@ -8,7 +8,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
-#include <math.h>
+#include <limits.h>
 
 #include <rte_ethdev.h>
 
@@ -19,15 +19,76 @@ void usage(void)
     puts("dpdk-replay [OPTIONS] PCAP_FILE PORT1[,PORTX...]\n"
          "PCAP_FILE: the file to send through the DPDK ports.\n"
          "PORT1[,PORTX...] : specify the list of ports to be used (pci addresses).\n"
+         "  DPDK virtual devices can be given too, with their arguments\n"
+         "  separated by ':', ie: net_null0:size=1500 (no NIC needed). The ports\n"
+         "  are numbered as DPDK does: the NICs in pci order, then the devices.\n"
          "Options:\n"
-         "--numacore <NUMA-CORE> : use cores from the desired NUMA. Only\n"
-         "  NICs on the selected numa core will be available (default is 0).\n"
+         "--numacore <NUMA-CORE> : numa of the main core, and of the ports whose\n"
+         "  numa is unknown (default is 0). The tx cores, mempools and pcap\n"
+         "  caches of each port are on the numa of its NIC.\n"
          "--nbruns <1-N> : set the wanted number of replay (1 by default).\n"
+         "--duration <sec>: replay the trace in loop during the given time, in\n"
+         "  seconds (decimals are allowed). ^C stops it earlier.\n"
+         "--loop-forever: replay the trace in loop until ^C.\n"
+         "--cores-per-port <1-N>: number of tx cores sending on each port, every\n"
+         "  one with its own slice of the pcap and its own tx queues (default 1).\n"
+         "--ports-per-core <1-N>: number of ports sent by each tx core, which\n"
+         "  interleaves their bursts (default 1).\n"
+         "--port-map <CORE1[,COREX...]>: index of the tx core sending each port,\n"
+         "  ie: 0,0,0,1 to send the 3 first ports with the same core.\n"
+         "--shared-cache: store packets only once in memory for all the ports\n"
+         "  instead of one copy per port.\n"
+         "--zero-copy: load the pcap file in hugepages and send the packets\n"
+         "  from it, without copying them in mbufs.\n"
+         "--multi-segs: store the packets bigger than 2048 bytes in chains of\n"
+         "  mbufs of 2048 bytes (the NICs must support multi segments tx).\n"
+         "--stream: read the pcap file while replaying it instead of caching it\n"
+         "  first, for files bigger than the hugepages memory. Packets bigger than\n"
+         "  9216 bytes are skipped.\n"
+         "--prefetch <1-N>: in streaming mode, number of bursts of packets read in\n"
+         "  advance for each port (1024 by default).\n"
+         "--maxbitrate <Mbit/s>: bitrate not to be exceeded on each port, in\n"
+         "  Mbit/s of L2 frames (default: no limit). Decimals are allowed.\n"
+         "--maxpps <pps>: packets per second not to be exceeded on each port\n"
+         "  (default: no limit).\n"
+         "--normalspeed: replay the trace with the timings of its packets.\n"
+         "--speed <X>: replay the trace X times faster than its timings (implies\n"
+         "  --normalspeed). Decimals are allowed, ie: 0.5 to replay it twice slower.\n"
+         "--lossless: when a tx queue is full, wait for the NIC to free it instead\n"
+         "  of dropping the packets after 200us.\n"
+         "--tx-cleanup: in lossless mode, ask the NIC driver to reclaim the sent\n"
+         "  descriptors of a full queue right away (implies --lossless).\n"
+         "--tx-queues <1-1024>: number of tx queues of each port (64 by default),\n"
+         "  capped by the NIC maximum.\n"
+         "--tx-desc <1-N>: number of descriptors of each tx queue (4096 by\n"
+         "  default), adjusted to the NIC limits.\n"
+         "--burst <1-128>: max number of packets per tx burst (128 by default).\n"
+         "--mbuf-cache <0-N>: size of the per core cache of the mempools (32 by\n"
+         "  default).\n"
+         "--tx-thresh <P,H,W[,F]>: prefetch, host, write-back and free thresholds\n"
+         "  of the tx queues (default: the ones of the NIC driver).\n"
+         "--stats <ms>: print the rates, drops and full tx queues of each port\n"
+         "  every given milliseconds during the replay.\n"
+         "--tx-histograms: record the cycles spent in each tx burst call and the\n"
+         "  number of packets it took, and print their percentiles (per port in\n"
+         "  --stats, per thread at the end). Needs a build with\n"
+         "  --enable-tx-histograms.\n"
+         "--results <json|csv>[:FILE]: also write the configuration and the\n"
+         "  results of each thread in JSON or CSV, in FILE or on stdout.\n"
+         "--autotune: before the replay, try the combinations of --burst,\n"
+         "  --tx-queues, --tx-desc and tx free threshold during 200ms each, and\n"
+         "  keep the fastest one (not with --stream or --normalspeed).\n"
+         "--autotune-save <FILE>: save the result of --autotune (implied) in FILE.\n"
+         "--profile <FILE>: load the tx parameters saved by --autotune-save.\n"
+         "--rewrite <FIELD[:MODE][,FIELD...]>: change the given fields on each\n"
+         "  run, to get new flows (not with --stream, --shared-cache or --zero-copy).\n"
+         "  FIELD is src-mac, dst-mac (low 24 bits), vlan, src-ip, dst-ip (low\n"
+         "  32 bits for IPv6), sport or dport. MODE is incr (+1 on each run, by\n"
+         "  default) or rand (a random delta per run), ie: src-ip,dport:rand.\n"
+         "--dry-run: print the memory needed on each numacore and the hugepages\n"
+         "  of each size to reserve, then exit without sending anything.\n"
          "--wait-enter: will wait until you press ENTER to start the replay (asked\n"
          "  once all the initialization are done)."
-         /* TODO: */
-         /* "[--maxbitrate bitrate]|[--normalspeed] : bitrate not to be exceeded (default: no limit) in ko/s.\n" */
-         /* "  specify --normalspeed to replay the trace with the good timings." */
         );
     return ;
 }
@@ -41,11 +102,48 @@ void print_opts(const struct cmd_opts* opts)
         return ;
     puts("--");
     printf("numacore: %i\n", (int)(opts->numacore));
-    printf("nb runs: %u\n", opts->nbruns);
-    /* if (opts->maxbitrate) */
-    /*     printf("MAX BITRATE: %u\n", opts->maxbitrate); */
-    /* else */
-    /*     puts("MAX BITRATE: FULL SPEED"); */
+    if (opts->loop_forever)
+        puts("nb runs: until ^C");
+    else if (opts->duration)
+        printf("nb runs: during %f sec\n", opts->duration);
+    else
+        printf("nb runs: %u\n", opts->nbruns);
+    printf("cores per port: %u\n", opts->cores_per_port);
+    printf("ports per core: %u\n", opts->ports_per_core);
+    if (opts->port_map)
+        printf("port map: %s\n", opts->port_map);
+    printf("shared cache: %s\n", opts->shared_cache ? "yes" : "no");
+    printf("zero copy: %s\n", opts->zero_copy ? "yes" : "no");
+    printf("multi segments: %s\n", opts->multi_segs ? "yes" : "no");
+    printf("dry run: %s\n", opts->dry_run ? "yes" : "no");
+    if (opts->stream)
+        printf("stream: prefetch %u bursts\n", opts->prefetch);
+    if (opts->maxbitrate)
+        printf("MAX BITRATE: %f Mbit/s\n", opts->maxbitrate);
+    else
+        puts("MAX BITRATE: FULL SPEED");
+    if (opts->maxpps)
+        printf("MAX PPS: %f\n", opts->maxpps);
+    if (opts->normalspeed)
+        printf("normal speed: x%f\n", opts->speed);
+    printf("tx queues: %u of %u descriptors, bursts of %u\n",
+           opts->tx_queues, opts->tx_desc, opts->burst_sz);
+    printf("mbuf cache: %u\n", opts->mbuf_cache);
+    printf("tx thresholds: %i/%i/%i, free %i\n", opts->tx_thresh[0],
+           opts->tx_thresh[1], opts->tx_thresh[2], opts->tx_thresh[3]);
+    if (opts->stats_ms)
+        printf("live stats: every %u ms\n", opts->stats_ms);
+    printf("tx histograms: %s\n", opts->tx_hists ? "yes" : "no");
+    if (opts->results_fmt)
+        printf("results: %s in %s\n", opts->results_fmt == RESULTS_JSON ? "json" : "csv",
+               opts->results_file ? opts->results_file : "stdout");
+    if (opts->autotune)
+        printf("autotune: yes%s%s\n", opts->autotune_save ? ", saved in " : "",
+               opts->autotune_save ? opts->autotune_save : "");
+    if (opts->rewrite)
+        printf("rewrite: 0x%x (rand: 0x%x)\n", opts->rewrite, opts->rewrite_rand);
+    printf("lossless: %s\n", opts->lossless ?
+           (opts->tx_cleanup ? "yes, with tx cleanup" : "yes") : "no");
     printf("trace: %s\n", opts->trace);
     printf("pci nic ports:");
     for (i = 0; opts->pcicards[i]; i++)
@@ -82,6 +180,47 @@ char** str_to_pcicards_list(struct cmd_opts* opts, char* pcis)
     return (list);
 }
 
+/* key of a pci address, to sort the ports. The virtual devices come last */
+static unsigned long get_pci_key(const char* port)
+{
+    unsigned int    domain, bus, dev, func;
+
+    if (IS_VDEV(port))
+        return (ULONG_MAX);
+    if (sscanf(port, "%x:%x:%x.%x", &domain, &bus, &dev, &func) != 4) {
+        domain = 0;
+        if (sscanf(port, "%x:%x.%x", &bus, &dev, &func) != 3)
+            return (ULONG_MAX);
+    }
+    return (((unsigned long)domain << 16) | (bus << 8) | (dev << 3) | func);
+}
+
+/*
+  DPDK numbers the NICs in pci order, then the virtual devices in the given
+  order: sort the ports list the same way, so that the i-th port of the list
+  is the DPDK port i.
+*/
+static void sort_pcicards(struct cmd_opts* opts)
+{
+    char*   port;
+    int     i, j, sorted;
+
+    for (i = 1, sorted = 1; i < opts->nb_pcicards; i++) {
+        port = opts->pcicards[i];
+        for (j = i; j > 0 && get_pci_key(opts->pcicards[j - 1]) > get_pci_key(port); j--)
+            opts->pcicards[j] = opts->pcicards[j - 1];
+        opts->pcicards[j] = port;
+        sorted &= (j == i);
+    }
+    if (sorted)
+        return ;
+    printf("-> Ports sorted in pci order, as numbered by DPDK:");
+    for (i = 0; i < opts->nb_pcicards; i++)
+        printf(" %s", opts->pcicards[i]);
+    putchar('\n');
+    return ;
+}
+
 int parse_options(const int ac, char** av, struct cmd_opts* opts)
 {
     int i;
@@ -103,7 +242,7 @@ int parse_options(const int ac, char** av, struct cmd_opts* opts)
                 return (ENOENT);
 
             nc = atoi(av[i + 1]);
-            if (nc < 0 || nc > 2)
+            if (nc < 0 || nc >= MAX_NUMA_NODES)
                 return (ENOENT);
             opts->numacore = (char)nc;
             i++;
@@ -122,6 +261,277 @@ int parse_options(const int ac, char** av, struct cmd_opts* opts)
             continue;
         }
 
+        /* --duration sec */
+        if (!strcmp(av[i], "--duration")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            opts->duration = atof(av[i + 1]);
+            if (opts->duration <= 0)
+                return (EPROTO);
+            i++;
+            continue;
+        }
+
+        /* --loop-forever */
+        if (!strcmp(av[i], "--loop-forever")) {
+            opts->loop_forever = 1;
+            continue;
+        }
+
+        /* --cores-per-port nb_cores */
+        if (!strcmp(av[i], "--cores-per-port")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            if (atoi(av[i + 1]) <= 0 || atoi(av[i + 1]) > MAX_TX_QUEUES)
+                return (EPROTO);
+            opts->cores_per_port = atoi(av[i + 1]);
+            i++;
+            continue;
+        }
+
+        /* --ports-per-core nb_ports */
+        if (!strcmp(av[i], "--ports-per-core")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            if (atoi(av[i + 1]) <= 0)
+                return (EPROTO);
+            opts->ports_per_core = atoi(av[i + 1]);
+            i++;
+            continue;
+        }
+
+        /* --port-map core_idx,... */
+        if (!strcmp(av[i], "--port-map")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            opts->port_map = av[i + 1];
+            i++;
+            continue;
+        }
+
+        /* --shared-cache */
+        if (!strcmp(av[i], "--shared-cache")) {
+            opts->shared_cache = 1;
+            continue;
+        }
+
+        /* --zero-copy */
+        if (!strcmp(av[i], "--zero-copy")) {
+#if API_OLDEST_THAN(18, 05)
+            puts("--zero-copy needs DPDK 18.05 or newer (external buffers).");
+            return (ENOTSUP);
+#endif /* API_OLDEST_THAN(18, 05) */
+            opts->zero_copy = 1;
+            continue;
+        }
+
+        /* --dry-run */
+        if (!strcmp(av[i], "--dry-run")) {
+            opts->dry_run = 1;
+            continue;
+        }
+
+        /* --multi-segs */
+        if (!strcmp(av[i], "--multi-segs")) {
+            opts->multi_segs = 1;
+            continue;
+        }
+
+        /* --stream */
+        if (!strcmp(av[i], "--stream")) {
+            opts->stream = 1;
+            continue;
+        }
+
+        /* --prefetch nb_batches */
+        if (!strcmp(av[i], "--prefetch")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            if (atoi(av[i + 1]) <= 0)
+                return (EPROTO);
+            opts->prefetch = atoi(av[i + 1]);
+            i++;
+            continue;
+        }
+
+        /* --maxbitrate Mbit/s */
+        if (!strcmp(av[i], "--maxbitrate")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            opts->maxbitrate = atof(av[i + 1]);
+            if (opts->maxbitrate <= 0)
+                return (EPROTO);
+            i++;
+            continue;
+        }
+
+        /* --maxpps pps */
+        if (!strcmp(av[i], "--maxpps")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            opts->maxpps = atof(av[i + 1]);
+            if (opts->maxpps <= 0)
+                return (EPROTO);
+            i++;
+            continue;
+        }
+
+        /* --normalspeed */
+        if (!strcmp(av[i], "--normalspeed")) {
+            opts->normalspeed = 1;
+            continue;
+        }
+
+        /* --speed multiplier */
+        if (!strcmp(av[i], "--speed")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            opts->speed = atof(av[i + 1]);
+            if (opts->speed <= 0)
+                return (EPROTO);
+            opts->normalspeed = 1;
+            i++;
+            continue;
+        }
+
+        /* --lossless */
+        if (!strcmp(av[i], "--lossless")) {
+            opts->lossless = 1;
+            continue;
+        }
+
+        /* --tx-cleanup */
+        if (!strcmp(av[i], "--tx-cleanup")) {
+            opts->tx_cleanup = opts->lossless = 1;
+            continue;
+        }
+
+        /* --tx-queues nb_queues */
+        if (!strcmp(av[i], "--tx-queues")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            if (atoi(av[i + 1]) <= 0 || atoi(av[i + 1]) > MAX_TX_QUEUES)
+                return (EPROTO);
+            opts->tx_queues = atoi(av[i + 1]);
+            i++;
+            continue;
+        }
+
+        /* --tx-desc nb_descriptors */
+        if (!strcmp(av[i], "--tx-desc")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            if (atoi(av[i + 1]) <= 0 || atoi(av[i + 1]) > UINT16_MAX)
+                return (EPROTO);
+            opts->tx_desc = atoi(av[i + 1]);
+            i++;
+            continue;
+        }
+
+        /* --burst nb_pkts */
+        if (!strcmp(av[i], "--burst")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            if (atoi(av[i + 1]) <= 0 || atoi(av[i + 1]) > BURST_SZ)
+                return (EPROTO);
+            opts->burst_sz = atoi(av[i + 1]);
+            i++;
+            continue;
+        }
+
+        /* --mbuf-cache nb_mbufs */
+        if (!strcmp(av[i], "--mbuf-cache")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            if (atoi(av[i + 1]) < 0)
+                return (EPROTO);
+            opts->mbuf_cache = atoi(av[i + 1]);
+            i++;
+            continue;
+        }
+
+        /* --tx-thresh pthresh,hthresh,wthresh[,free_thresh] */
+        if (!strcmp(av[i], "--tx-thresh")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            if (sscanf(av[i + 1], "%i,%i,%i,%i", &(opts->tx_thresh[0]), &(opts->tx_thresh[1]),
+                       &(opts->tx_thresh[2]), &(opts->tx_thresh[3])) < 3 ||
+                opts->tx_thresh[0] < 0 || opts->tx_thresh[0] > UINT8_MAX ||
+                opts->tx_thresh[1] < 0 || opts->tx_thresh[1] > UINT8_MAX ||
+                opts->tx_thresh[2] < 0 || opts->tx_thresh[2] > UINT8_MAX ||
+                opts->tx_thresh[3] < -1 || opts->tx_thresh[3] > UINT16_MAX)
+                return (EPROTO);
+            i++;
+            continue;
+        }
+
+        /* --stats period_ms */
+        if (!strcmp(av[i], "--stats")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            if (atoi(av[i + 1]) <= 0)
+                return (EPROTO);
+            opts->stats_ms = atoi(av[i + 1]);
+            i++;
+            continue;
+        }
+
+        /* --tx-histograms */
+        if (!strcmp(av[i], "--tx-histograms")) {
+#ifndef TX_HISTOGRAMS
+            puts("--tx-histograms needs a build configured with --enable-tx-histograms.");
+            return (EINVAL);
+#endif /* TX_HISTOGRAMS */
+            opts->tx_hists = 1;
+            continue;
+        }
+
+        /* --results format[:file] */
+        if (!strcmp(av[i], "--results")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            if (str_to_results(opts, av[i + 1]))
+                return (EPROTO);
+            i++;
+            continue;
+        }
+
+        /* --autotune */
+        if (!strcmp(av[i], "--autotune")) {
+            opts->autotune = 1;
+            continue;
+        }
+
+        /* --autotune-save profile_file */
+        if (!strcmp(av[i], "--autotune-save")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            opts->autotune_save = av[i + 1];
+            opts->autotune = 1;
+            i++;
+            continue;
+        }
+
+        /* --profile profile_file */
+        if (!strcmp(av[i], "--profile")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            if (load_profile(opts, av[i + 1]))
+                return (EPROTO);
+            i++;
+            continue;
+        }
+
+        /* --rewrite fields */
+        if (!strcmp(av[i], "--rewrite")) {
+            if (i + 1 >= ac - 2)
+                return (ENOENT);
+            if (str_to_rewrite_fields(opts, av[i + 1]))
+                return (EPROTO);
+            i++;
+            continue;
+        }
+
         /* --wait-enter */
         if (!strcmp(av[i], "--wait-enter")) {
             opts->wait = 1;
@@ -134,76 +544,241 @@ int parse_options(const int ac, char** av, struct cmd_opts* opts)
         return (EPROTO);
     opts->trace = av[i];
     opts->pcicards = str_to_pcicards_list(opts, av[i + 1]);
+    if (!opts->pcicards)
+        return (ENOMEM);
+    sort_pcicards(opts);
+    /* sharing the packets data makes no sense with a single port */
+    if (opts->nb_pcicards < 2)
+        opts->shared_cache = 0;
+    /* nothing is cached when streaming */
+    if (opts->stream && (opts->shared_cache || opts->zero_copy)) {
+        puts("--stream can't be used with --shared-cache or --zero-copy.");
+        return (EINVAL);
+    }
+    /* the gaps between packets are computed when caching the file */
+    if (opts->stream && opts->normalspeed) {
+        puts("--stream can't be used with --normalspeed or --speed.");
+        return (EINVAL);
+    }
+    /* a port is either split over several cores, or sharing one */
+    if (opts->cores_per_port > 1 && (opts->ports_per_core || opts->port_map)) {
+        puts("--cores-per-port can't be used with --ports-per-core or --port-map.");
+        return (EINVAL);
+    }
+    /* the pkts timings can't be kept over several cores */
+    if (opts->normalspeed && opts->cores_per_port > 1) {
+        puts("--cores-per-port can't be used with --normalspeed or --speed.");
+        return (EINVAL);
+    }
+    /* each core of a port needs its own tx queues */
+    if (opts->cores_per_port > opts->tx_queues) {
+        puts("--cores-per-port can't be bigger than --tx-queues.");
+        return (EINVAL);
+    }
+    /* only the pkts copied in cached mbufs are chained */
+    if (opts->multi_segs && (opts->stream || opts->zero_copy)) {
+        puts("--multi-segs can't be used with --stream or --zero-copy.");
+        return (EINVAL);
+    }
+    /* the trials replay the cache at full speed */
+    if (opts->autotune && (opts->stream || opts->normalspeed)) {
+        puts("--autotune can't be used with --stream or --normalspeed.");
+        return (EINVAL);
+    }
+    /* the pkts are rewritten in place: their data can't be shared by ports */
+    if (opts->rewrite && (opts->stream || opts->shared_cache || opts->zero_copy)) {
+        puts("--rewrite can't be used with --stream, --shared-cache or --zero-copy.");
+        return (EINVAL);
+    }
     return (0);
 }
 
-int check_needed_memory(const struct cmd_opts* opts, const struct pcap_ctx* pcap,
-                        struct dpdk_ctx* dpdk)
+/* size of the mbufs holding packets up to pkt_sz bytes */
+static unsigned long get_mbuf_sz(const unsigned int pkt_sz)
 {
-    float           needed_mem;
-    char*           hsize;
-
-    if (!opts || !pcap || !dpdk)
-        return (EINVAL);
+    unsigned long   mbuf_sz;
 
-    /* # CALCULATE THE NEEDED SIZE FOR MBUF STRUCTS */
-    dpdk->mbuf_sz = sizeof(struct rte_mbuf) + pcap->max_pkt_sz;
-    dpdk->mbuf_sz += (dpdk->mbuf_sz % (sizeof(int)));
+    mbuf_sz = sizeof(struct rte_mbuf) + pkt_sz;
+    mbuf_sz += (mbuf_sz % (sizeof(int)));
 #ifdef DEBUG
     puts("Needed paket allocation size = "
-         "(size of MBUF) + (size of biggest pcap packet), "
+         "(size of MBUF) + (size of biggest pcap packet of the class), "
          "rounded up to the next multiple of an integer.");
     printf("(%lu + %u) + ((%lu + %u) %% %lu) = %lu\n",
-           sizeof(struct rte_mbuf), pcap->max_pkt_sz,
-           sizeof(struct rte_mbuf), pcap->max_pkt_sz,
-           sizeof(int), dpdk->mbuf_sz);
+           sizeof(struct rte_mbuf), pkt_sz, sizeof(struct rte_mbuf), pkt_sz,
+           sizeof(int), mbuf_sz);
 #endif /* DEBUG */
-    printf("-> Needed MBUF size: %lu\n", dpdk->mbuf_sz);
+    return (mbuf_sz);
+}
 
-    /* # CALCULATE THE NEEDED NUMBER OF MBUFS */
+/* number of mbufs of a mempool for nb_pkts pkts, sent by nb_ports ports */
+static unsigned long get_nb_mbufs(const struct cmd_opts* opts, const unsigned int nb_pkts,
+                                  const unsigned int nb_copies, const unsigned int nb_ports)
+{
+    unsigned long   nb_mbufs;
+
+    if (opts->stream) {
+        /*
+          Streaming: enough mbufs to fill a ring (mbufs are shared by the
+          rings of all ports), plus the ones owned by the NICs tx queues.
+        */
+        nb_mbufs = get_next_power_of_2(opts->prefetch * BURST_SZ)
+            + opts->nb_pcicards * opts->tx_queues * opts->tx_desc;
+    } else {
 #ifdef DPDK_RECOMMANDATIONS
-    /* For number of pkts to be allocated on the mempool, DPDK says: */
-    /* The optimum size (in terms of memory usage) for a mempool is when n is a
-       power of two minus one: n = (2^q - 1).  */
+        /* For number of pkts to be allocated on the mempool, DPDK says: */
+        /* The optimum size (in terms of memory usage) for a mempool is when n is a
+           power of two minus one: n = (2^q - 1).  */
 #ifdef DEBUG
-    puts("Needed number of MBUFS: next power of two minus one of "
-         "(nb pkts * nb ports)");
+        puts("Needed number of MBUFS: next power of two minus one of "
+             "(nb pkts * nb copies)");
 #endif /* DEBUG */
-    dpdk->nb_mbuf = get_next_power_of_2(pcap->nb_pkts * opts->nb_pcicards) - 1;
+        nb_mbufs = get_next_power_of_2(nb_pkts * nb_copies) - 1;
 #else /* !DPDK_RECOMMANDATIONS */
+        /*
+          Some tests shown that the perf are not so much impacted when allocating the
+          exact number of wanted mbufs. I keep it simple for now to reduce the needed
+          memory on large pcap.
+        */
+        nb_mbufs = nb_pkts * nb_copies;
+#endif /* DPDK_RECOMMANDATIONS */
+    }
     /*
-      Some tests shown that the perf are not so much impacted when allocating the
-      exact number of wanted mbufs. I keep it simple for now to reduce the needed
-      memory on large pcap.
+      Mbufs are allocated (caches filling) or freed (streaming) by the tx
+      lcores: each of them can keep up to --mbuf-cache mbufs in its
+      mempool cache, that the others can't get.
     */
-    dpdk->nb_mbuf = pcap->nb_pkts * opts->nb_pcicards;
-#endif /* DPDK_RECOMMANDATIONS */
+    nb_mbufs += nb_ports * opts->cores_per_port * opts->mbuf_cache;
     /*
       If we have a pcap with very few packets, we need to allocate more mbufs
       than necessary to avoid rte_mempool_create failure.
     */
-    if (dpdk->nb_mbuf < (MBUF_CACHE_SZ * 2))
-        dpdk->nb_mbuf = MBUF_CACHE_SZ * 4;
-    printf("-> Needed number of MBUFS: %lu\n", dpdk->nb_mbuf);
+    if (nb_mbufs < (opts->mbuf_cache * 2))
+        nb_mbufs = opts->mbuf_cache * 4;
+    return (nb_mbufs);
+}
+
+/*
+  The mbufs (and the pcap image) are allocated on the numacore of the ports
+  sending them: each numacore with ports gets its own mempools, sized for
+  its ports. The streaming mempool is shared by all the ports, on --numacore.
+  Each size class with packets gets its own mempool (see MBUF_CLASSES).
+*/
+int check_needed_memory(const struct cmd_opts* opts, const struct pcap_ctx* pcap,
+                        const struct cpus_bindings* cpus, struct dpdk_ctx* dpdk)
+{
+    float           needed_mem, single_mem;
+    char*           hsize;
+    unsigned int    nb_copies, nb_ports, nb_images, c;
+    int             n;
+
+    if (!opts || !pcap || !cpus || !dpdk)
+        return (EINVAL);
+
+    /* unless chained, a packet must fit in a single mbuf, whose data length is on 16 bits */
+    if (pcap->max_pkt_sz > UINT16_MAX && !opts->multi_segs) {
+        printf("%s: packets of %u bytes can't be stored in a mbuf (%u max, see --multi-segs).\n",
+               __FUNCTION__, pcap->max_pkt_sz, UINT16_MAX);
+        return (EFBIG);
+    }
+
+    for (n = 0, nb_images = 0; n < MAX_NUMA_NODES; n++)
+        nb_images += (cpus->numa_ports[n] != 0);
+    if (opts->zero_copy) {
+        /* # THE PACKETS STAY IN THE PCAP IMAGE: ONLY DATA-LESS MBUFS ARE NEEDED */
+        dpdk->image_sz = pcap->map_sz;
+        printf("-> Needed pcap image size: %lu (x%u numacores)\n", dpdk->image_sz,
+               nb_images);
+    } else {
+        /* # CALCULATE THE NEEDED SIZE FOR MBUF STRUCTS, FOR EACH SIZE CLASS */
+        for (c = 0; c < NB_MBUF_CLASSES; c++) {
+            if (!pcap->class_max_sz[c])
+                continue;
+            dpdk->mbuf_szs[c] = get_mbuf_sz(pcap->class_max_sz[c]);
+            if (opts->stream)
+                printf("-> Needed MBUF size: %lu\n", dpdk->mbuf_szs[c]);
+            else
+                printf("-> Needed MBUF size: %lu (for %u mbufs of up to %u bytes)\n",
+                       dpdk->mbuf_szs[c], pcap->class_pkts[c], pcap->class_max_sz[c]);
+        }
+    }
+
+    if (!opts->zero_copy)
+        nb_images = 0;
+    needed_mem = dpdk->image_sz * nb_images;
+    single_mem = 0;
+    dpdk->nb_mbuf = dpdk->nb_indirect_mbuf = 0;
+    for (n = 0; n < MAX_NUMA_NODES; n++) {
+        nb_ports = cpus->numa_ports[n];
+        if (opts->stream) {
+            /* all the ports are fed by the mempool of --numacore */
+            if (n != cpus->numacore)
+                continue;
+            nb_ports = opts->nb_pcicards;
+        } else if (!nb_ports)
+            continue;
+        /* in shared cache mode, packets data are stored only once per numacore */
+        nb_copies = (opts->shared_cache ? 1 : nb_ports);
+
+        /* # CALCULATE THE NEEDED NUMBER OF MBUFS, FOR EACH SIZE CLASS */
+        for (c = 0; c < NB_MBUF_CLASSES && !opts->zero_copy; c++) {
+            if (!pcap->class_max_sz[c])
+                continue;
+            dpdk->nb_mbufs[n][c] = get_nb_mbufs(opts, pcap->class_pkts[c], nb_copies,
+                                                nb_ports);
+            printf("-> Needed number of MBUFS of %lu octs on numacore %i: %lu\n",
+                   dpdk->mbuf_szs[c], n, dpdk->nb_mbufs[n][c]);
+            dpdk->nb_mbuf += dpdk->nb_mbufs[n][c];
+            needed_mem += dpdk->mbuf_szs[c] * dpdk->nb_mbufs[n][c];
+        }
+        /* what a single mempool of mbufs sized for the biggest packet would take */
+        if (!opts->zero_copy && !opts->stream)
+            single_mem += get_mbuf_sz(pcap->max_pkt_sz)
+                * get_nb_mbufs(opts, pcap->nb_pkts, nb_copies, nb_ports);
+
+        /*
+          # CALCULATE THE NEEDED NUMBER OF INDIRECT MBUFS
+          In shared cache and zero copy modes, each port cache is made of
+          data-less mbufs attached to the ones holding the packets, or directly
+          to the packets of the pcap image.
+        */
+        if (opts->shared_cache || opts->zero_copy) {
+            dpdk->indirect_mbuf_sz = sizeof(struct rte_mbuf);
+            dpdk->nb_indirect_mbufs[n] = pcap->nb_segs * nb_ports
+                + nb_ports * opts->cores_per_port * opts->mbuf_cache;
+            if (dpdk->nb_indirect_mbufs[n] < (opts->mbuf_cache * 2))
+                dpdk->nb_indirect_mbufs[n] = opts->mbuf_cache * 4;
+            printf("-> Needed number of indirect MBUFS on numacore %i: %lu\n", n,
+                   dpdk->nb_indirect_mbufs[n]);
+            dpdk->nb_indirect_mbuf += dpdk->nb_indirect_mbufs[n];
+        }
+    }
 
     /* # CALCULATE THE TOTAL NEEDED MEMORY SIZE  */
-    needed_mem = dpdk->mbuf_sz * dpdk->nb_mbuf;
+    needed_mem += dpdk->indirect_mbuf_sz * dpdk->nb_indirect_mbuf;
 #ifdef DEBUG
-    puts("Needed memory = (needed mbuf size) * (number of needed mbuf).");
-    printf("%lu * %lu = %.0f bytes\n", dpdk->mbuf_sz, dpdk->nb_mbuf, needed_mem);
+    puts("Needed memory = sum of (mbuf size) * (number of mbufs) of each mempool"
+         " + (indirect mbuf size) * (number of indirect mbuf)"
+         " + (pcap image size) * (number of numacores with ports).");
+    printf("mbufs + %lu * %lu + %lu * %u = %.0f bytes\n",
+           dpdk->indirect_mbuf_sz, dpdk->nb_indirect_mbuf, dpdk->image_sz, nb_images,
+           needed_mem);
 #endif /* DEBUG */
+    /* the size classes saving, against mbufs all sized for the biggest packet */
+    single_mem += dpdk->indirect_mbuf_sz * dpdk->nb_indirect_mbuf;
+    if (single_mem > needed_mem) {
+        hsize = nb_oct_to_human_str(single_mem - needed_mem);
+        if (!hsize)
+            return (-1);
+        printf("-> Size classes save %s (%.1f%% of %.0f bytes)\n", hsize,
+               100 * (single_mem - needed_mem) / single_mem, single_mem);
+        free(hsize);
+    }
     hsize = nb_oct_to_human_str(needed_mem);
     if (!hsize)
         return (-1);
     printf("-> Needed Memory = %s\n", hsize);
     free(hsize);
-
-    /* # CALCULATE THE NEEDED NUMBER OF GIGABYTE HUGEPAGES */
-    if (fmod(needed_mem,((double)(1024*1024*1024))))
-        dpdk->pool_sz = needed_mem / (float)(1024*1024*1024) + 1;
-    else
-        dpdk->pool_sz = needed_mem / (1024*1024*1024);
-    printf("-> Needed Hugepages of 1 Go = %lu\n", dpdk->pool_sz);
     return (0);
 }
 
@@ -221,6 +796,14 @@ int main(const int ac, char** av)
     bzero(&dpdk, sizeof(dpdk));
     bzero(&pcap, sizeof(pcap));
     opts.nbruns = 1;
+    opts.prefetch = STREAM_PREFETCH;
+    opts.speed = 1;
+    opts.cores_per_port = 1;
+    opts.tx_queues = NB_TX_QUEUES;
+    opts.tx_desc = TX_QUEUE_SIZE;
+    opts.burst_sz = BURST_SZ;
+    opts.mbuf_cache = MBUF_CACHE_SZ;
+    opts.tx_thresh[0] = opts.tx_thresh[1] = opts.tx_thresh[2] = opts.tx_thresh[3] = -1;
 
     /* parse cmdline options */
     ret = parse_options(ac, av, &opts);
@@ -236,13 +819,17 @@ int main(const int ac, char** av)
       pre parse the pcap file to get needed informations:
       . number of packets
       . biggest packet size
+      or, when streaming it, only check its header.
     */
-    ret = preload_pcap(&opts, &pcap);
+    if (opts.stream)
+        ret = open_stream(&opts, &pcap, &dpdk);
+    else
+        ret = preload_pcap(&opts, &pcap);
     if (ret)
         goto mainExit;
 
-    /* calculate needed memory to allocate for mempool */
-    ret = check_needed_memory(&opts, &pcap, &dpdk);
+    /* find the headers to rewrite in each packet */
+    ret = init_rewrite(&opts, &pcap);
     if (ret)
         goto mainExit;
 
@@ -254,21 +841,54 @@ int main(const int ac, char** av)
     if (ret)
         goto mainExit;
 
+    /* calculate needed memory to allocate for the mempools of each numacore */
+    ret = check_needed_memory(&opts, &pcap, &cpus, &dpdk);
+    if (ret)
+        goto mainExit;
+
+    /* check the hugepages of each numacore before the long part */
+    ret = check_hugepages(&opts, &pcap, &cpus, &dpdk);
+    if (ret || opts.dry_run)
+        goto mainExit;
+
+    /* counters of the tasks, and live stats */
+    ret = init_stats(&opts, &cpus, &(dpdk.stats));
+    if (ret)
+        goto mainExit;
+
     /* init dpdk eal and mempool */
     ret = init_dpdk_eal_mempool(&opts, &cpus, &dpdk);
     if (ret)
         goto mainExit;
 
-    /* cache pcap file into mempool */
-    ret = load_pcap(&opts, &pcap, &cpus, &dpdk);
+    /* let the monitoring poll the replay */
+    init_telemetry(&opts, &dpdk);
+
+    /* check if the NICs can send the pkts at their timestamps */
+    ret = init_tx_timestamp(&opts, &cpus, &dpdk);
+    if (ret)
+        goto mainExit;
+
+    /* cache pcap file into mempool, or prepare the rings to stream it */
+    if (opts.stream)
+        ret = init_stream(&opts, &cpus, &dpdk);
+    else
+        ret = load_pcap(&opts, &pcap, &cpus, &dpdk);
     if (ret)
         goto mainExit;
 
     /* init dpdk ports to send pkts */
-    ret = init_dpdk_ports(&cpus);
+    ret = init_dpdk_ports(&opts, &cpus, &dpdk);
     if (ret)
         goto mainExit;
 
+    /* find the best tx parameters on these ports */
+    if (opts.autotune) {
+        ret = autotune(&opts, &cpus, &dpdk, &pcap);
+        if (ret)
+            goto mainExit;
+    }
+
     /* start tx threads and wait to start to send pkts */
     ret = start_tx_threads(&opts, &cpus, &dpdk, &pcap);
     if (ret)
@@ -280,5 +900,9 @@ mainExit:
     dpdk_cleanup(&dpdk, &cpus);
     if (cpus.cpus_to_use)
         free(cpus.cpus_to_use);
+    free(cpus.task_lcore);
+    free(cpus.lcores);
+    free(cpus.port_numa);
+    free(cpus.lcore_numa);
     return (ret);
 }
@@ -8,16 +8,78 @@
 
 #include <stdint.h>
 #include <semaphore.h>
+#include <time.h>
 
+/* defaults of --mbuf-cache, --tx-desc, --tx-queues and --burst */
 #define MBUF_CACHE_SZ   32
-#define TX_QUEUE_SIZE   4096
-#define NB_TX_QUEUES    64 /* ^2 needed to make fast modulos % */
-#define BURST_SZ        128
-#define NB_RETRY_TX     (NB_TX_QUEUES * 2)
+#define TX_QUEUE_SIZE   4096 /* adjusted to the NIC descriptors limits */
+#define NB_TX_QUEUES    64 /* capped by the NIC max tx queues */
+#define BURST_SZ        128 /* also the max burst size */
+#define MAX_TX_QUEUES   1024
+#define TX_RETRY_US     200 /* time given to full tx queues before dropping */
+#define MAX_NUMA_NODES  8 /* as RTE_MAX_NUMA_NODES */
+/*
+  Size classes of the mbufs holding the cached packets: a packet goes in the
+  mempool of the smallest class holding it, whose mbufs are sized for the
+  biggest packet of the class, so a few jumbos don't make every mbuf big.
+*/
+#define NB_MBUF_CLASSES 5
+#define MBUF_CLASSES    { 128, 512, 2048, 9216, UINT16_MAX } /* max data size */
+#define MBUF_SEG_SZ     2048 /* --multi-segs: segments of the bigger pkts, a class size */
+/*
+  The cached mbufs refcnt is the number of runs they can still be sent: the
+  PMD frees don't give them back to the mempool. It is armed with at most
+  MBUF_REFCNT_ARM runs (refcnt is on 16 bits), and re-armed every
+  MBUF_REFCNT_REARM runs. Both are lowered for the small caches, whose mbufs
+  can also be referenced many times by the tx queues (see arm_tx_tasks).
+*/
+#define MBUF_REFCNT_ARM     32768
+#define MBUF_REFCNT_REARM   16384
+
+#define PACING_WINDOW_NS    1000 /* max duration of a paced burst on the wire */
+#define TX_TS_LEAD_NS       1000000 /* hw timestamps: delay before the first pkt */
+#define TX_TS_CALIB_MS      100 /* hw timestamps: device clock measurement time */
+
+/*
+  On the wire, an ethernet frame is padded to 64 bytes with its FCS, and
+  takes 20 more bytes: preamble and SFD (8) and the inter frame gap (12).
+  The pcap lengths are without FCS.
+*/
+#define ETH_MIN_FRAME_SZ    60 /* without the FCS */
+#define ETH_WIRE_OVERHEAD   24 /* FCS, preamble, SFD and IFG */
+#define WIRE_SZ(len)        (((len) < ETH_MIN_FRAME_SZ ? ETH_MIN_FRAME_SZ : (len)) + ETH_WIRE_OVERHEAD)
+
+#define STATS_ALIGN         128 /* tasks counters alignment, 2 cache lines of 64B */
+/*
+  --tx-histograms log-linear histograms: exact values under
+  2^(HIST_SUB_BITS + 1), then 2^HIST_SUB_BITS buckets per power of 2 (12.5%
+  precision).
+*/
+#define HIST_SUB_BITS       3
+#define HIST_NB_BUCKETS     ((2 << HIST_SUB_BITS) + (64 - HIST_SUB_BITS - 1) * (1 << HIST_SUB_BITS))
+#define AUTOTUNE_TRIAL_MS   200 /* duration of each --autotune trial */
 
-#define TX_PTHRESH 36 // Default value of TX prefetch threshold register.
-#define TX_HTHRESH 0  // Default value of TX host threshold register.
-#define TX_WTHRESH 0  // Default value of TX write-back threshold register.
+#define STREAM_PREFETCH     1024 /* default nb of BURST_SZ batches per stream ring */
+#define STREAM_MAX_PKT_SZ   9216 /* biggest packet replayed in streaming mode */
+#define STREAM_CHUNK_SZ     (4 * 1024 * 1024) /* size of the O_DIRECT reads */
+#define STREAM_ALIGN        4096 /* O_DIRECT buffers and sizes alignment */
+
+/* a virtual device in the ports list, ie: net_null0 (see fill_eal_args) */
+#define IS_VDEV(name)   (!strncmp((name), "net_", 4))
+
+/* formats of --results (see results.c) */
+#define RESULTS_JSON    1
+#define RESULTS_CSV     2
+
+/* fields of --rewrite (see rewrite.c) */
+#define RW_SRC_MAC      0
+#define RW_DST_MAC      1
+#define RW_VLAN         2
+#define RW_SRC_IP       3
+#define RW_DST_IP       4
+#define RW_SPORT        5
+#define RW_DPORT        6
+#define RW_NB_FIELDS    7
 
 #ifndef min
 #define min(x, y) (x < y ? x : y)
@@ -36,27 +98,123 @@
       && defined RTE_VER_MONTH && RTE_VER_MONTH >= month) \
      || defined RTE_VER_YEAR && RTE_VER_YEAR >= year)
 
+/*
+  PCAP file format
+*/
+#define PCAP_MAGIC (0xa1b2c3d4)
+#define PCAP_NSEC_MAGIC (0xa1b23c4d) /* ts_usec holds nanoseconds */
+#define PCAP_MAJOR_VERSION (2)
+#define PCAP_MINOR_VERSION (4)
+#define PCAP_SNAPLEN (262144)
+#define PCAP_NETWORK (1) /* ethernet layer */
+typedef struct pcap_hdr_s {
+    uint32_t magic_number;   /* magic number */
+    uint16_t version_major;  /* major version number */
+    uint16_t version_minor;  /* minor version number */
+    int32_t  thiszone;       /* GMT to local correction */
+    uint32_t sigfigs;        /* accuracy of timestamps */
+    uint32_t snaplen;        /* max length of captured packets, in octets */
+    uint32_t network;        /* data link type */
+} __attribute__((__packed__)) pcap_hdr_t;
+
+typedef struct pcaprec_hdr_s {
+        uint32_t ts_sec;         /* timestamp seconds */
+        uint32_t ts_usec;        /* timestamp microseconds (or nanoseconds) */
+        uint32_t incl_len;       /* number of octets of packet saved in file */
+        uint32_t orig_len;       /* actual length of packet */
+} __attribute__((__packed__)) pcaprec_hdr_t;
+
 /* struct to store the command line args */
 struct cmd_opts {
     char**          pcicards;
     int             nb_pcicards;
     int             numacore;
     int             nbruns;
-    unsigned int    maxbitrate;
+    int             loop_forever; /* replay until interrupted */
+    double          duration; /* in sec, 0 for no limit */
+    unsigned int    cores_per_port; /* nb of tx lcores for each port */
+    unsigned int    ports_per_core; /* nb of ports sent by each tx lcore */
+    char*           port_map; /* tx lcore index of each port, comma separated */
+    double          maxbitrate; /* in Mbit/s, 0 for no limit */
+    double          maxpps; /* 0 for no limit */
+    int             normalspeed; /* replay with the pcap timings */
+    double          speed; /* multiplier of the pcap timings */
+    int             lossless; /* wait for the tx queues instead of dropping */
+    int             tx_cleanup; /* reclaim the sent descriptors of full queues */
+    unsigned int    tx_queues; /* per port, capped by the NIC */
+    unsigned int    tx_desc; /* per tx queue, adjusted to the NIC limits */
+    unsigned int    burst_sz; /* max nb of pkts per tx burst */
+    unsigned int    mbuf_cache; /* per lcore cache of the mempools */
+    int             tx_thresh[4]; /* p/h/w and free thresholds, -1 for the driver's */
+    unsigned int    stats_ms; /* live stats period, 0 for none */
+    int             tx_hists; /* time the tx bursts, see TX_HISTOGRAMS */
+    int             results_fmt; /* RESULTS_*, 0 for the text only */
+    char*           results_file; /* NULL for stdout */
+    int             autotune; /* find the best tx parameters before the replay */
+    char*           autotune_save; /* profile file to save them in */
+    unsigned int    rewrite; /* mask of the RW_* fields changed on each run */
+    unsigned int    rewrite_rand; /* ... with a random delta instead of +1 */
     int             wait;
+    int             dry_run; /* only print the memory plan */
+    int             shared_cache;
+    int             zero_copy;
+    int             multi_segs; /* chain the pkts bigger than MBUF_SEG_SZ */
+    int             stream;
+    unsigned int    prefetch; /* stream ring depth, in nb of BURST_SZ batches */
     char*           trace;
 };
 
 /* struct to store the cpus context */
 struct                  cpus_bindings {
     int                 numacores; /* nb of numacores of the system */
-    int                 numacore; /* wanted numacore to run */
+    int                 numacore; /* of the main lcore, and of the ports without one */
+    int*                port_numa; /* numacore of each port */
+    int*                lcore_numa; /* numacore of each tx lcore, the one of its ports */
+    unsigned int        numa_ports[MAX_NUMA_NODES]; /* nb of ports on each numacore */
     unsigned int        nb_available_cpus;
-    unsigned int        nb_needed_cpus;
+    unsigned int        nb_needed_cpus; /* tx lcores, without the fake master */
+    unsigned int        nb_ports;
+    unsigned int        cores_per_port;
+    unsigned int        nb_tasks; /* port (or slice of port) sent by a tx lcore */
+    unsigned int*       task_lcore; /* index of the tx lcore of each task */
     unsigned int*       cpus_to_use;
     char*               prefix;
     char*               suffix;
-    uint64_t            coremask;
+    char*               lcores; /* EAL lcores list, lcore i on cpus_to_use[i] */
+};
+
+/* counters published by a task for the live stats, written by it only */
+struct                  task_stats {
+    volatile uint64_t   pkts; /* given to the NIC */
+    volatile uint64_t   drops;
+    volatile uint64_t   full_queues; /* times a burst found its queues full */
+    volatile uint64_t   underruns; /* streaming mode: times its ring was empty */
+} __attribute__((aligned(STATS_ALIGN)));
+
+struct                  hist {
+    uint64_t            count[HIST_NB_BUCKETS];
+    uint64_t            max;
+};
+
+/* cost of the rte_eth_tx_burst calls of a task, see --tx-histograms */
+struct                  tx_hists {
+    struct hist         cycles; /* tsc cycles per call */
+    struct hist         pkts; /* pkts accepted per call */
+} __attribute__((aligned(STATS_ALIGN)));
+
+/* struct to store the live stats context (see stats.c) */
+struct                  stats_ctx {
+    const struct cpus_bindings* cpus;
+    struct task_stats*  tasks; /* one per task */
+    unsigned int        nb_tasks;
+    uint64_t            period_tsc; /* 0 if not printed */
+    uint64_t            start_tsc;
+    uint64_t            prev_tsc;
+    uint64_t            next_tsc;
+    struct task_stats*  prev_tasks; /* counters of the previous print */
+    struct rte_eth_stats* prev_ports;
+    struct tx_hists*    hists; /* one per task, with --tx-histograms */
+    struct hist*        prev_cycles; /* cycles histograms of the previous print */
 };
 
 /* struct corresponding to a cache for one NIC port */
@@ -64,44 +222,191 @@ struct                  pcap_cache {
     struct rte_mbuf**   mbufs;
 };
 
+/* struct to store the streaming replay context (see stream.c) */
+struct                  stream_ctx {
+    int                 fd;
+    int                 direct; /* is fd opened with O_DIRECT */
+    unsigned char*      buf; /* read buffer: room for a partial record, then a chunk */
+    size_t              buf_sz;
+    unsigned char*      pos; /* next record to parse in the buffer */
+    unsigned char*      end; /* end of the read data in the buffer */
+    unsigned int        max_pkt_sz; /* biggest packet an mbuf can hold */
+    int                 nbruns; /* 0 to read the file until stopped */
+    int                 run_cpt;
+    uint64_t            end_tsc; /* --duration end, 0 for none */
+    const volatile int* quit; /* set on SIGINT */
+    int                 stop;
+    struct stats_ctx*   stats; /* live stats, printed by the reader */
+    unsigned int        nb_rings;
+    struct rte_ring**   rings; /* one ring of mbufs per NIC port */
+    struct rte_mempool* pool;
+    struct rte_mbuf*    batch[BURST_SZ]; /* packets waiting to be enqueued */
+    unsigned int        batch_len;
+    unsigned int        batch_ring; /* next ring to enqueue the batch on */
+    volatile int        done; /* all runs have been enqueued */
+    /* stats */
+    unsigned long       nb_pkts;
+    unsigned long       read_sz;
+    unsigned long       nb_stalls; /* times the reader waited for a full ring */
+    unsigned long       nb_skipped; /* packets bigger than max_pkt_sz */
+    double              duration;
+};
+
 /* struct to store dpdk context */
 struct                  dpdk_ctx {
-    unsigned long       nb_mbuf; /* number of needed mbuf (see main.c) */
-    unsigned long       mbuf_sz; /* wanted/needed size for the mbuf (see main.c) */
-    unsigned long       pool_sz; /* mempool wanted/needed size (see main.c) */
-    struct rte_mempool* pktmbuf_pool;
+    /* one mempool per size class (and pcap image) per numacore with ports */
+    unsigned long       nb_mbuf; /* number of needed mbuf, all numacores (see main.c) */
+    unsigned long       nb_mbufs[MAX_NUMA_NODES][NB_MBUF_CLASSES];
+    unsigned long       mbuf_szs[NB_MBUF_CLASSES]; /* needed size of the mbufs (see main.c) */
+    unsigned long       numa_mem[MAX_NUMA_NODES]; /* needed hugepages memory (see memory.c) */
+    struct rte_mempool* pktmbuf_pools[MAX_NUMA_NODES][NB_MBUF_CLASSES];
+    unsigned long       nb_indirect_mbuf; /* shared cache mode only (see main.c) */
+    unsigned long       nb_indirect_mbufs[MAX_NUMA_NODES];
+    unsigned long       indirect_mbuf_sz;
+    struct rte_mempool* indirect_pools[MAX_NUMA_NODES];
+    unsigned long       image_sz; /* zero copy mode only, of each image (see main.c) */
+    const struct rte_memzone* images[MAX_NUMA_NODES]; /* pcap file image, in zero copy mode */
+    struct rte_mbuf_ext_shared_info* image_shinfos[MAX_NUMA_NODES]; /* refcnts of each image */
+    unsigned int*       nb_tx_queues; /* configured tx queues, one per port */
+    unsigned int*       tx_ring_sz; /* descriptors of all the tx queues, one per port */
+    int*                tx_done_cleanup; /* the PMD of the port reclaims sent pkts on demand */
 
     /* pcap file caches */
     long int            pcap_sz; /* size of the capture */
     struct pcap_cache*  pcap_caches; /* tab of caches, one per NIC port */
+    unsigned int        armed_runs; /* initial refcnt of the cached mbufs */
+
+    /* streaming mode */
+    struct stream_ctx   stream;
+
+    /* live stats */
+    struct stats_ctx    stats;
+
+    /* tx timestamp offload, in normalspeed mode */
+    int                 tx_ts; /* enabled on all the ports */
+    int                 ts_offset; /* mbuf dynfield of the timestamp */
+    uint64_t            ts_flag; /* mbuf flag to send on timestamp */
+    double*             ts_ratio; /* device clock ticks per ns, one per port */
 };
 
-/* struct to store threads context */
+/* struct to store threads context: one per task (port, or slice of a port) */
 struct                  thread_ctx {
     sem_t*              sem;
     pthread_t           thread;
+    struct thread_ctx*  next; /* next task of the same tx lcore */
+    int                 finished;
     int                 tx_port_id; /* assigned tx port id */
     int                 nbruns;
+    int                 run_cpt; /* nb of runs left */
+    int                 forever; /* --loop-forever or --duration */
+    unsigned int        armed_runs; /* runs covered by the mbufs refcnt */
+    unsigned int        arm_max; /* max armed runs, for the refcnt not to wrap */
+    unsigned int        rearm_runs; /* runs given by each re-arm */
+    uint64_t            runs_done;
+    uint64_t            replay_tsc; /* --duration, in tsc cycles */
+    uint64_t            end_tsc;
+    const volatile int* quit; /* set on SIGINT */
+    unsigned int        first_pkt; /* slice of the port cache sent by the task */
     unsigned int        nb_pkt;
+    unsigned int        index; /* next pkt to send in the slice */
+    struct rte_mbuf**   mbufs; /* the slice */
+    unsigned int        tx_queue; /* tx queues round robin */
+    int                 tx_queue_base; /* first tx queue owned by the thread */
     int                 nb_tx_queues;
+    int                 burst_sz;
+    long int            pcap_sz;
+    uint64_t            pcap_wire_sz; /* pcap_sz, as sent on the wire */
+    /* full tx queues handling */
+    int                 lossless;
+    int                 tx_cleanup;
+    uint64_t            retry_tsc; /* time given to the queues before dropping */
+    unsigned int        nb_pending; /* pkts of the burst not given to the NIC yet */
+    uint64_t            blocked_since; /* tsc of the first full queue, or 0 */
+    uint64_t            blocked_tsc[MAX_TX_QUEUES]; /* per owned queue */
+    /* --rewrite */
+    const struct rewrite_pkt* rw_pkts; /* of the slice */
+    unsigned int        rw_fields;
+    unsigned int        rw_rand;
+    uint32_t            rw_diff[RW_NB_FIELDS]; /* to add to the fields on this run */
+    /* pacing (see --maxbitrate and --maxpps), in tsc cycles */
+    int                 paced;
+    double              tsc_per_byte;
+    double              tsc_per_pkt;
+    uint64_t            next_tsc; /* earliest time to send the next burst */
+    const uint64_t*     ipg; /* normalspeed only */
+    uint64_t            timed_tsc; /* time to send the current pkt at */
+    uint64_t            window_tsc; /* pkts due in this window are sent together */
+    double              expected_duration; /* normalspeed only, in sec */
+    /* tx timestamp offload, in device clock ticks */
+    int                 tx_ts;
+    int                 ts_offset;
+    double              ts_ratio;
+    uint64_t            ts_shift; /* added to the pkts timestamps on next run */
+    uint64_t            run_ticks; /* duration of one run */
+    uint64_t            last_ts; /* timestamp of the last pkt given to the NIC */
     /* results */
     double              duration;
-    unsigned int        total_drop;
-    unsigned int        total_drop_sz;
+    uint64_t            total_pkt; /* nb of pkts given to the NIC */
+    uint64_t            total_pkt_sz; /* L2 bytes */
+    uint64_t            total_wire_sz; /* bytes on the wire, see WIRE_SZ */
+    uint64_t            total_drop;
+    uint64_t            total_drop_sz;
+    uint64_t            total_drop_wire_sz;
+    uint64_t            run_drop; /* drops of the current run */
     struct pcap_cache*  pcap_cache;
+    /* streaming mode */
+    struct rte_ring*    ring;
+    const struct stream_ctx* stream;
+    uint64_t            nb_underruns; /* times the ring was found empty */
+    struct task_stats*  live; /* published counters */
+    struct tx_hists*    hists; /* NULL if not timed */
+    int                 empty;
+    struct rte_mbuf*    burst[BURST_SZ]; /* dequeued, waiting to be sent */
+    unsigned int        burst_len;
+};
+
+/* offsets of the headers of a packet, for --rewrite */
+struct                  rewrite_pkt {
+    uint8_t             l2; /* ethernet header found */
+    uint8_t             l3; /* 4, 6, or 0 if not IP */
+    uint8_t             l4; /* TCP or UDP protocol, or 0 */
+    uint16_t            vlan_off; /* tci of the first vlan tag, or 0 */
+    uint16_t            l3_off;
+    uint16_t            l4_off;
+};
+
+/* index entry of a packet inside the mapped pcap file */
+struct                  pcap_pkt {
+    uint64_t            offset; /* offset of the packet data in the file */
+    uint32_t            len; /* captured length of the packet */
 };
 
 struct                  pcap_ctx {
     int                 fd;
     unsigned int        nb_pkts;
     unsigned int        max_pkt_sz;
+    unsigned int        nb_segs; /* mbufs of a copy of the pkts, chains segments included */
+    unsigned int        class_pkts[NB_MBUF_CLASSES]; /* nb of mbufs of each size class */
+    unsigned int        class_max_sz[NB_MBUF_CLASSES]; /* biggest pkt of each size class */
     size_t              cap_sz;
+    unsigned char*      map; /* whole pcap file, mmaped read only */
+    size_t              map_sz;
+    struct pcap_pkt*    pkts; /* packets index, filled by preload_pcap */
+    uint64_t*           ipg; /* normalspeed only: gap from the previous pkt,
+                                in ns after preload_pcap, then in tsc cycles */
+    uint64_t            ipg_sum; /* duration of one run, in tsc cycles */
+    struct rewrite_pkt* rw_pkts; /* --rewrite only */
 };
 
 /*
   FUNC PROTOTYPES
 */
 
+/* AUTOTUNE.C */
+int             load_profile(struct cmd_opts* opts, const char* path);
+int             autotune(struct cmd_opts* opts, struct cpus_bindings* cpus,
+                         struct dpdk_ctx* dpdk, const struct pcap_ctx* pcap);
+
 /* CPUS.C */
 int             init_cpus(const struct cmd_opts* opts, struct cpus_bindings* cpus);
 
@@ -109,20 +414,75 @@ int             init_cpus(const struct cmd_opts* opts, struct cpus_bindings* cpu
 int             init_dpdk_eal_mempool(const struct cmd_opts* opts,
                                       const struct cpus_bindings* cpus,
                                       struct dpdk_ctx* dpdk);
-int             init_dpdk_ports(struct cpus_bindings* cpus);
+int             init_tx_timestamp(const struct cmd_opts* opts,
+                                  const struct cpus_bindings* cpus,
+                                  struct dpdk_ctx* dpdk);
+unsigned int    get_link_speed(const int port);
+int             init_dpdk_ports(const struct cmd_opts* opts, struct cpus_bindings* cpus,
+                                struct dpdk_ctx* dpdk);
+int             restart_dpdk_ports(const struct cmd_opts* opts, struct cpus_bindings* cpus,
+                                   struct dpdk_ctx* dpdk, const int verbose);
 void*           myrealloc(void* ptr, size_t new_size);
-int             start_tx_threads(const struct cmd_opts* opts,
+struct thread_ctx* init_tx_tasks(const struct cmd_opts* opts,
                                  const struct cpus_bindings* cpus,
                                  const struct dpdk_ctx* dpdk,
+                                 const struct pcap_ctx* pcap, sem_t* sem);
+int             arm_tx_tasks(const struct cpus_bindings* cpus, const struct dpdk_ctx* dpdk,
+                             struct thread_ctx* ctx);
+int             launch_tx_tasks(const struct cpus_bindings* cpus, struct thread_ctx* ctx);
+int             start_tx_threads(const struct cmd_opts* opts,
+                                 const struct cpus_bindings* cpus,
+                                 struct dpdk_ctx* dpdk,
                                  const struct pcap_ctx *pcap);
 void            dpdk_cleanup(struct dpdk_ctx* dpdk, struct cpus_bindings* cpus);
+double          timespec_diff_to_double(const struct timespec start,
+                                        const struct timespec end);
+
+/* MEMORY.C */
+int             check_hugepages(const struct cmd_opts* opts, const struct pcap_ctx* pcap,
+                                const struct cpus_bindings* cpus, struct dpdk_ctx* dpdk);
 
 /* PCAP.C */
+int             check_pcap_hdr(const pcap_hdr_t* pcap_h);
 int             preload_pcap(const struct cmd_opts* opts, struct pcap_ctx* pcap);
+unsigned int    get_mbuf_class(const unsigned int len);
 int             load_pcap(const struct cmd_opts* opts, struct pcap_ctx* pcap,
                           const struct cpus_bindings* cpus, struct dpdk_ctx* dpdk);
 void            clean_pcap_ctx(struct pcap_ctx* pcap);
 
+/* REWRITE.C */
+int             str_to_rewrite_fields(struct cmd_opts* opts, char* list);
+int             init_rewrite(const struct cmd_opts* opts, struct pcap_ctx* pcap);
+void            rewrite_run_diff(const unsigned int fields, const unsigned int rand,
+                                 const unsigned long run, uint32_t* diff);
+void            rewrite_pkts(struct rte_mbuf** mbuf, const struct rewrite_pkt* pkts,
+                             const unsigned int nb, const uint32_t* diff);
+
+/* RESULTS.C */
+int             str_to_results(struct cmd_opts* opts, char* arg);
+double          get_cycles_per_pkt(const struct cpus_bindings* cpus,
+                                   const struct thread_ctx* ctx, const unsigned int task);
+int             write_results(const struct cmd_opts* opts, const struct cpus_bindings* cpus,
+                              const struct thread_ctx* ctx);
+
+/* STATS.C */
+int             init_stats(const struct cmd_opts* opts, const struct cpus_bindings* cpus,
+                           struct stats_ctx* stats);
+void            start_stats(struct stats_ctx* stats);
+void            poll_stats(struct stats_ctx* stats);
+void            wait_tx_lcores(const struct cpus_bindings* cpus, struct stats_ctx* stats);
+void            clean_stats(struct stats_ctx* stats);
+void            init_telemetry(const struct cmd_opts* opts, const struct dpdk_ctx* dpdk);
+void            print_tx_hists(const struct tx_hists* hists);
+
+/* STREAM.C */
+int             open_stream(const struct cmd_opts* opts, struct pcap_ctx* pcap,
+                            struct dpdk_ctx* dpdk);
+int             init_stream(const struct cmd_opts* opts, const struct cpus_bindings* cpus,
+                            struct dpdk_ctx* dpdk);
+int             stream_pcap(struct stream_ctx* stream, const int prime);
+void            clean_stream(struct stream_ctx* stream);
+
 /* UTILS.C */
 char*           nb_oct_to_human_str(float size);
 unsigned int    get_next_power_of_2(const unsigned int nb);
@@ -0,0 +1,232 @@
+/*
+  SPDX-License-Identifier: BSD-3-Clause
+  Copyright 2018 Jonathan Ribas, FraudBuster. All rights reserved.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include <rte_common.h>
+#include <rte_mbuf.h>
+#include <rte_mempool.h>
+#include <rte_ring.h>
+
+#include "main.h"
+
+/*
+  Memory planner: before the EAL init, compute what each numacore needs in
+  hugepages, as DPDK will allocate it, and check it against the free
+  hugepages of each size given by sysfs, so that a too big trace fails in
+  seconds instead of after its preload. With --dry-run, the plan is only
+  printed.
+*/
+
+#define HUGEPAGES_NUMA_SYSFS    "/sys/devices/system/node/node%i/hugepages"
+#define HUGEPAGES_SYSFS         "/sys/kernel/mm/hugepages"
+#define MAX_HUGEPAGES_SZS       4
+/* estimates: the PMD descriptors size is only known once the EAL is up */
+#define TX_DESC_MEM             64 /* a tx descriptor and its sw ring entry */
+#define DPDK_MEM_MARGIN         (16 << 20) /* DPDK own allocations on each numacore */
+
+struct                  hugepages {
+    unsigned long       sz;
+    unsigned long       nb_free;
+};
+
+/*
+  Hugepages memory of a mempool, the way rte_mempool_create lays it out: the
+  objects with their header, the mempool header with the caches of all the
+  lcores, and the ring of its free objects (default mempool handler). The
+  mbufs headroom is part of their data room, and unused (data_off is 0).
+*/
+static unsigned long get_mempool_mem(const unsigned long nb, const unsigned long elt_sz,
+                                     const unsigned int cache, unsigned long* obj_sz)
+{
+    unsigned long   mem;
+
+    *obj_sz = rte_mempool_calc_obj_size(elt_sz, 0, NULL);
+    mem = nb * *obj_sz;
+    mem += RTE_ALIGN_CEIL(sizeof(struct rte_mempool)
+                          + (cache ? RTE_MAX_LCORE * sizeof(struct rte_mempool_cache) : 0)
+                          + sizeof(struct rte_pktmbuf_pool_private), RTE_CACHE_LINE_SIZE);
+    mem += rte_ring_get_memsize(rte_align32pow2(nb + 1));
+    return (mem);
+}
+
+/* estimated: the part of the memory which is estimated, not computed */
+static unsigned long get_numa_mem(const struct cmd_opts* opts,
+                                  const struct cpus_bindings* cpus,
+                                  const struct dpdk_ctx* dpdk, const int numa,
+                                  unsigned long* max_obj_sz, unsigned long* estimated)
+{
+    unsigned long   mem, obj_sz;
+    unsigned int    c, i;
+
+    mem = *max_obj_sz = *estimated = 0;
+    for (c = 0; c < NB_MBUF_CLASSES; c++) {
+        if (!dpdk->nb_mbufs[numa][c])
+            continue;
+        mem += get_mempool_mem(dpdk->nb_mbufs[numa][c], dpdk->mbuf_szs[c],
+                               opts->mbuf_cache, &obj_sz);
+        *max_obj_sz = RTE_MAX(*max_obj_sz, obj_sz);
+    }
+    if (dpdk->nb_indirect_mbufs[numa]) {
+        mem += get_mempool_mem(dpdk->nb_indirect_mbufs[numa], dpdk->indirect_mbuf_sz,
+                               opts->mbuf_cache, &obj_sz);
+        *max_obj_sz = RTE_MAX(*max_obj_sz, obj_sz);
+    }
+    if (dpdk->image_sz && cpus->numa_ports[numa])
+        mem += dpdk->image_sz;
+
+    /* the stream rings and the tx queues of the ports of this numacore */
+    for (i = 0; i < cpus->nb_ports; i++) {
+        if (cpus->port_numa[i] != numa)
+            continue;
+        if (opts->stream)
+            mem += rte_ring_get_memsize(get_next_power_of_2(opts->prefetch * BURST_SZ));
+        *estimated += (unsigned long)opts->tx_queues * opts->tx_desc * TX_DESC_MEM;
+    }
+    if (mem || *estimated)
+        *estimated += DPDK_MEM_MARGIN;
+    return (mem + *estimated);
+}
+
+/* free hugepages of each size of a numacore, sorted by size. -1 if unknown */
+static int get_free_hugepages(const int numa, struct hugepages* hp)
+{
+    char            path[128];
+    struct dirent*  ent;
+    DIR*            dir;
+    FILE*           f;
+    unsigned long   kb, nb_free;
+    int             nb, i;
+
+    snprintf(path, sizeof(path), HUGEPAGES_NUMA_SYSFS, numa);
+    dir = opendir(path);
+    /* kernels without numa only have the global counters */
+    if (!dir && !numa) {
+        snprintf(path, sizeof(path), HUGEPAGES_SYSFS);
+        dir = opendir(path);
+    }
+    if (!dir)
+        return (-1);
+
+    nb = 0;
+    while (nb < MAX_HUGEPAGES_SZS && (ent = readdir(dir))) {
+        if (sscanf(ent->d_name, "hugepages-%lukB", &kb) != 1)
+            continue;
+        snprintf(path + strlen(path), sizeof(path) - strlen(path), "/%s/free_hugepages",
+                 ent->d_name);
+        f = fopen(path, "r");
+        *strrchr(path, '/') = '\0';
+        *strrchr(path, '/') = '\0';
+        if (!f)
+            continue;
+        if (fscanf(f, "%lu", &nb_free) == 1) {
+            for (i = nb; i > 0 && hp[i - 1].sz > kb * 1024; i--)
+                hp[i] = hp[i - 1];
+            hp[i].nb_free = nb_free;
+            hp[i].sz = kb * 1024;
+            nb++;
+        }
+        fclose(f);
+    }
+    closedir(dir);
+    return (nb);
+}
+
+static void print_hugepage_sz(const unsigned long sz)
+{
+    if (sz >= (1UL << 30))
+        printf("%lu Go", sz >> 30);
+    else if (sz >= (1UL << 20))
+        printf("%lu Mo", sz >> 20);
+    else
+        printf("%lu Ko", sz >> 10);
+    return ;
+}
+
+/*
+  Unless DPDK uses IOVA as VA, the mempool objects don't cross the pages
+  boundaries: the end of each page, up to an object, can be lost.
+*/
+static unsigned long get_nb_hugepages(const unsigned long mem, const unsigned long max_obj_sz,
+                                      const unsigned long sz)
+{
+    if (max_obj_sz >= sz)
+        return (mem / sz + 1);
+    return ((mem + sz - max_obj_sz - 1) / (sz - max_obj_sz));
+}
+
+/* the memory sure to be usable in the free hugepages of a size, as above */
+static unsigned long get_usable_mem(const struct hugepages* hp, const unsigned long max_obj_sz)
+{
+    if (!hp->nb_free)
+        return (0);
+    if (max_obj_sz >= hp->sz)
+        return ((hp->nb_free - 1) * hp->sz);
+    return (hp->nb_free * (hp->sz - max_obj_sz));
+}
+
+int check_hugepages(const struct cmd_opts* opts, const struct pcap_ctx* pcap,
+                    const struct cpus_bindings* cpus, struct dpdk_ctx* dpdk)
+{
+    struct hugepages    hp[MAX_HUGEPAGES_SZS];
+    unsigned long       max_obj_sz, estimated, free_mem, process_mem;
+    char*               hsize;
+    int                 n, i, nb_sz, ret;
+
+    if (!opts || !pcap || !cpus || !dpdk)
+        return (EINVAL);
+
+    ret = 0;
+    for (n = 0; n < MAX_NUMA_NODES; n++) {
+        dpdk->numa_mem[n] = get_numa_mem(opts, cpus, dpdk, n, &max_obj_sz, &estimated);
+        if (!dpdk->numa_mem[n])
+            continue;
+        hsize = nb_oct_to_human_str(dpdk->numa_mem[n]);
+        if (!hsize)
+            return (-1);
+        printf("-> Needed hugepages memory on numacore %i = %s (%lu bytes)\n", n, hsize,
+               dpdk->numa_mem[n]);
+        free(hsize);
+        hsize = nb_oct_to_human_str(estimated);
+        if (!hsize)
+            return (-1);
+        printf("   of which %s are estimated (tx descriptors, DPDK own allocations)\n", hsize);
+        free(hsize);
+
+        nb_sz = get_free_hugepages(n, hp);
+        if (nb_sz <= 0) {
+            printf("   no hugepages found in sysfs for numacore %i, not checked.\n", n);
+            continue;
+        }
+        for (i = 0, free_mem = 0; i < nb_sz; i++) {
+            printf("   hugepages of ");
+            print_hugepage_sz(hp[i].sz);
+            printf(": %lu needed, %lu free\n",
+                   get_nb_hugepages(dpdk->numa_mem[n], max_obj_sz, hp[i].sz), hp[i].nb_free);
+            free_mem += get_usable_mem(&(hp[i]), max_obj_sz);
+        }
+        /* DPDK takes the pages of all the mounted sizes */
+        if (free_mem < dpdk->numa_mem[n]) {
+            printf("%s: not enough free hugepages on numacore %i (%lu bytes usable).\n",
+                   __FUNCTION__, n, free_mem);
+            ret = ENOMEM;
+        }
+    }
+
+    /* out of the hugepages, the process allocates the mbufs pointers of each port cache */
+    if (opts->stream)
+        return (ret);
+    process_mem = sizeof(struct rte_mbuf*) * pcap->nb_pkts * cpus->nb_ports;
+    hsize = nb_oct_to_human_str(process_mem);
+    if (!hsize)
+        return (-1);
+    printf("-> Needed process memory for the caches = %s\n", hsize);
+    free(hsize);
+    return (ret);
+}
@@ -10,184 +10,563 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 #include <rte_malloc.h>
 #include <rte_mbuf.h>
+#include <rte_memzone.h>
+#include <rte_errno.h>
+#include <rte_cycles.h>
 
 #include "main.h"
 
-#define MAX_PKT_SZ (1024*64) /* 64ko */
+#define PCAP_INDEX_INIT_SZ (1024*64) /* initial nb of entries of the packets index */
 
-/*
-  PCAP file header
-*/
-#define PCAP_MAGIC (0xa1b2c3d4)
-#define PCAP_MAJOR_VERSION (2)
-#define PCAP_MINOR_VERSION (4)
-#define PCAP_SNAPLEN (262144)
-#define PCAP_NETWORK (1) /* ethernet layer */
-typedef struct pcap_hdr_s {
-    uint32_t magic_number;   /* magic number */
-    uint16_t version_major;  /* major version number */
-    uint16_t version_minor;  /* minor version number */
-    int32_t  thiszone;       /* GMT to local correction */
-    uint32_t sigfigs;        /* accuracy of timestamps */
-    uint32_t snaplen;        /* max length of captured packets, in octets */
-    uint32_t network;        /* data link type */
-} __attribute__((__packed__)) pcap_hdr_t;
-
-typedef struct pcaprec_hdr_s {
-        uint32_t ts_sec;         /* timestamp seconds */
-        uint32_t ts_usec;        /* timestamp microseconds */
-        uint32_t incl_len;       /* number of octets of packet saved in file */
-        uint32_t orig_len;       /* actual length of packet */
-} __attribute__((__packed__)) pcaprec_hdr_t;
-
-int check_pcap_hdr(const int fd)
+static const unsigned int mbuf_classes[NB_MBUF_CLASSES] = MBUF_CLASSES;
+
+/* smallest mbuf size class holding the packet */
+unsigned int get_mbuf_class(const unsigned int len)
 {
-    pcap_hdr_t  pcap_h;
-    size_t      nb_read;
-
-    nb_read = read(fd, &pcap_h, sizeof(pcap_h));
-    if (nb_read != sizeof(pcap_h))
-        return (EIO);
-    if (pcap_h.magic_number != PCAP_MAGIC ||
-        pcap_h.version_major != PCAP_MAJOR_VERSION ||
-        pcap_h.version_minor != PCAP_MINOR_VERSION) {
+    unsigned int    c;
+
+    for (c = 0; c < NB_MBUF_CLASSES - 1 && len > mbuf_classes[c]; c++) ;
+    return (c);
+}
+
+int check_pcap_hdr(const pcap_hdr_t* pcap_h)
+{
+    if ((pcap_h->magic_number != PCAP_MAGIC &&
+         pcap_h->magic_number != PCAP_NSEC_MAGIC) ||
+        pcap_h->version_major != PCAP_MAJOR_VERSION ||
+        pcap_h->version_minor != PCAP_MINOR_VERSION) {
         printf("%s: check failed. magic (0x%.8x), major: %u, minor: %u\n",
-               __FUNCTION__, pcap_h.magic_number,
-               pcap_h.version_major, pcap_h.version_minor);
+               __FUNCTION__, pcap_h->magic_number,
+               pcap_h->version_major, pcap_h->version_minor);
         return (EPROTO);
     }
     return (0);
 }
 
-int add_pkt_to_cache(const struct dpdk_ctx* dpdk, const int cache_index,
-                     const unsigned char* pkt_buf, const size_t pkt_sz,
+/* context of a cache filling thread */
+struct                  load_ctx {
+    const struct pcap_ctx* pcap;
+    struct pcap_cache*  caches; /* caches to fill */
+    unsigned int        nb_caches;
+    unsigned int        first_pkt; /* slice of the packets index to cache */
+    unsigned int        nb_pkts;
+    struct rte_mempool* const* pool; /* size classes mempools to alloc mbufs from */
+    /* shared cache and zero copy modes: one copy of the pkts per numacore */
+    struct rte_mempool* (*pools)[NB_MBUF_CLASSES];
+    struct rte_mempool* const* indirect_pools;
+    const struct rte_memzone* const* images; /* zero copy mode only */
+    struct rte_mbuf_ext_shared_info* const* image_shinfos; /* see init_image_shinfos */
+    const int*          cache_numa; /* numacore of each cache */
+    int                 nbruns; /* runs covered by the mbufs refcnt */
+    int                 multi_segs; /* chain the pkts bigger than MBUF_SEG_SZ */
+    const uint64_t*     ts_ns; /* tx timestamp offload: pkts times in the run */
+    const double*       ts_ratio; /* device clock ticks per ns, one per cache */
+    int                 ts_offset;
+    uint64_t            ts_flag;
+    unsigned int        lcore; /* index of the tx lcore doing the job */
+    struct load_ctx*    next; /* next job of the same lcore */
+    volatile unsigned int cpt; /* nb of cached pkts, read by main for progress */
+    volatile int        done;
+    int                 ret;
+};
+
+/* copy a packet in a mbuf, or in the MBUF_SEG_SZ segments of a chain */
+static void copy_pkt_to_mbuf(struct rte_mbuf* m, const unsigned char* pkt_buf,
+                             const size_t pkt_sz)
+{
+    struct rte_mbuf*    seg;
+    size_t              off, len;
+
+    m->pkt_len = pkt_sz;
+    for (seg = m, off = 0; seg; seg = seg->next, off += len) {
+        len = (seg->next ? MBUF_SEG_SZ : pkt_sz - off);
+        rte_memcpy((char*)seg->buf_addr, pkt_buf + off, len);
+        seg->data_off = 0;
+        seg->data_len = len;
+    }
+    return ;
+}
+
+int add_pkt_to_cache(struct pcap_cache* cache, struct rte_mbuf* m,
                      const unsigned int cpt, const int nbruns)
 {
-    struct rte_mbuf* m;
+    struct rte_mbuf*    seg;
 
-    if (!dpdk || !pkt_buf)
+    if (!cache || !m)
         return (EINVAL);
 
-    m = rte_pktmbuf_alloc(dpdk->pktmbuf_pool);
-    if (!m) {
-        printf("\n%s rte_pktmbuf_alloc failed. exiting.\n", __FUNCTION__);
-        return (ENOMEM);
-    }
-    rte_memcpy((char*)m->buf_addr, pkt_buf, pkt_sz);
-    m->data_off = 0;
-    m->data_len = m->pkt_len = pkt_sz;
-    m->nb_segs = 1;
-    m->next = NULL;
-
     /* set the refcnt to the wanted number of runs, avoiding to free
-       mbuf struct on first tx burst */
-    rte_mbuf_refcnt_set(m, nbruns);
+       mbuf struct on first tx burst (each segment is freed on its own) */
+    for (seg = m; seg; seg = seg->next)
+        rte_mbuf_refcnt_set(seg, nbruns);
 
     /* check that the crafted packet is valid */
     rte_mbuf_sanity_check(m, 1);
 
     /* assign new cached pkt to list */
-    dpdk->pcap_caches[cache_index].mbufs[cpt] = m;
+    cache->mbufs[cpt] = m;
     return (0);
 }
 
-int preload_pcap(const struct cmd_opts* opts, struct pcap_ctx* pcap)
+/* tx timestamp offload: stamp the mbuf of the given cache with its pkt time */
+static inline void stamp_pkt(const struct load_ctx* ctx __rte_unused,
+                             struct rte_mbuf* m __rte_unused,
+                             const unsigned int cache __rte_unused,
+                             const unsigned int cpt __rte_unused)
 {
-    unsigned char   pkt_buf[MAX_PKT_SZ];
-    pcaprec_hdr_t   pcap_rechdr;
-    struct stat     s;
-    unsigned int    cpt;
-    size_t          nb_read;
-    long int        total_read;
-    float           percent;
-    int             ret;
+#if API_AT_LEAST_AS_RECENT_AS(20, 11)
+    if (!ctx->ts_ns)
+        return ;
+    *RTE_MBUF_DYNFIELD(m, ctx->ts_offset, uint64_t*) = ctx->ts_ns[cpt] * ctx->ts_ratio[cache];
+    m->ol_flags |= ctx->ts_flag;
+#endif /* API_AT_LEAST_AS_RECENT_AS(20, 11) */
+    return ;
+}
 
-    if (!opts || !pcap)
-        return (EINVAL);
+#if API_AT_LEAST_AS_RECENT_AS(18, 05)
+/*
+  The pcap image is freed with its memzone, once all mbufs are gone: nothing
+  to do when an mbuf attached to it is released.
+*/
+static void image_free_cb(void* addr __rte_unused, void* opaque __rte_unused)
+{
+    return ;
+}
+
+/*
+  The refcnt of an external buffer counts the mbufs attached to it, on 16
+  bits: an image has a shared info for each slice of pkts whose attaches
+  (one per cache, of all the caches at most) fit in it, its refcnt set to
+  the number of attaches of the caches of the numacore before attaching them.
+*/
+static int init_image_shinfos(struct dpdk_ctx* dpdk, const struct pcap_ctx* pcap,
+                              const unsigned int nb_caches,
+                              const unsigned int numa_caches, const int numa)
+{
+    struct rte_mbuf_ext_shared_info*    shinfos;
+    unsigned int                        slice, nb, i;
+
+    slice = UINT16_MAX / nb_caches;
+    nb = (pcap->nb_pkts + slice - 1) / slice;
+    shinfos = malloc(sizeof(*shinfos) * nb);
+    if (!shinfos)
+        return (ENOMEM);
+    bzero(shinfos, sizeof(*shinfos) * nb);
+    for (i = 0; i < nb; i++) {
+        shinfos[i].free_cb = image_free_cb;
+        shinfos[i].fcb_opaque = NULL;
+        rte_mbuf_ext_refcnt_set(&(shinfos[i]),
+                                min(slice, pcap->nb_pkts - i * slice) * numa_caches);
+    }
+    dpdk->image_shinfos[numa] = shinfos;
+    return (0);
+}
+#endif /* API_AT_LEAST_AS_RECENT_AS(18, 05) */
+
+/*
+  Attach one indirect mbuf per cache of the numacore to each of the given
+  mbufs, or to the packets of its pcap image in zero copy mode (bulk is then
+  NULL). Each attach takes a reference on the mbuf holding the data, which is
+  so never given back to the mempool: the indirect ones are released after
+  their last run, but the data one keeps the reference of its allocation.
+*/
+static int attach_pkts_to_caches(const struct load_ctx* ctx,
+                                 struct rte_mbuf** bulk, const int numa,
+                                 const unsigned int cpt, const unsigned int nb)
+{
+#if API_AT_LEAST_AS_RECENT_AS(18, 05)
+    const struct pcap_pkt*  pkt;
+    struct rte_mbuf_ext_shared_info* shinfo;
+#endif /* API_AT_LEAST_AS_RECENT_AS(18, 05) */
+    struct rte_mbuf*    indirect[BURST_SZ];
+    unsigned int        c, i;
+    int                 ret;
+
+    for (c = 0; c < ctx->nb_caches; c++) {
+        if (ctx->cache_numa[c] != numa)
+            continue;
+        if (rte_pktmbuf_alloc_bulk(ctx->indirect_pools[numa], indirect, nb)) {
+            fprintf(stderr, "\n%s: rte_pktmbuf_alloc_bulk failed. exiting.\n",
+                    __FUNCTION__);
+            return (ENOMEM);
+        }
+        for (i = 0; i < nb; i++) {
+            if (bulk && bulk[i]->nb_segs > 1) {
+                /* a chain: one indirect mbuf per segment */
+                rte_pktmbuf_free(indirect[i]);
+                indirect[i] = rte_pktmbuf_clone(bulk[i], ctx->indirect_pools[numa]);
+                if (!indirect[i]) {
+                    fprintf(stderr, "\n%s: rte_pktmbuf_clone failed. exiting.\n",
+                            __FUNCTION__);
+                    return (ENOMEM);
+                }
+            } else if (bulk)
+                rte_pktmbuf_attach(indirect[i], bulk[i]);
+#if API_AT_LEAST_AS_RECENT_AS(18, 05)
+            else {
+                pkt = &(ctx->pcap->pkts[cpt + i]);
+                shinfo = &(ctx->image_shinfos[numa][(cpt + i) / (UINT16_MAX / ctx->nb_caches)]);
+                rte_pktmbuf_attach_extbuf(indirect[i],
+                                          (char*)ctx->images[numa]->addr + pkt->offset,
+                                          ctx->images[numa]->iova + pkt->offset,
+                                          pkt->len, shinfo);
+                indirect[i]->data_len = indirect[i]->pkt_len = pkt->len;
+            }
+#endif /* API_AT_LEAST_AS_RECENT_AS(18, 05) */
+            stamp_pkt(ctx, indirect[i], c, cpt + i);
+            ret = add_pkt_to_cache(&(ctx->caches[c]), indirect[i],
+                                   cpt + i, ctx->nbruns);
+            if (ret)
+                return (ret);
+        }
+    }
+    return (0);
+}
+
+/* --multi-segs: alloc the chain of MBUF_SEG_SZ segments of a pkt */
+static struct rte_mbuf* alloc_pkt_chain(struct rte_mempool* pool, const unsigned int len)
+{
+    struct rte_mbuf*    head;
+    struct rte_mbuf*    seg;
+    unsigned int        sz;
+
+    head = rte_pktmbuf_alloc(pool);
+    for (sz = MBUF_SEG_SZ, seg = head; head && sz < len; sz += MBUF_SEG_SZ) {
+        seg->next = rte_pktmbuf_alloc(pool);
+        if (!seg->next) {
+            rte_pktmbuf_free(head);
+            return (NULL);
+        }
+        seg = seg->next;
+        head->nb_segs++;
+    }
+    return (head);
+}
+
+/*
+  Alloc the mbufs of a burst of pkts, each one from its size class mempool,
+  or as a chain of segments for the big ones with --multi-segs.
+*/
+/* --multi-segs: give back the chains of the first nb pkts of a failed bulk */
+static void free_pkt_chains(const struct pcap_ctx* pcap, struct rte_mbuf** bulk,
+                            const unsigned int cpt, const unsigned int nb)
+{
+    unsigned int    i;
+
+    for (i = 0; i < nb; i++)
+        if (pcap->pkts[cpt + i].len > MBUF_SEG_SZ)
+            rte_pktmbuf_free(bulk[i]);
+    return ;
+}
+
+static int alloc_pkts_bulk(const struct pcap_ctx* pcap, struct rte_mempool* const* pools,
+                           struct rte_mbuf** bulk, const unsigned int cpt,
+                           const unsigned int nb, const int multi_segs)
+{
+    struct rte_mbuf*    classes[NB_MBUF_CLASSES][BURST_SZ];
+    unsigned int        nb_class[NB_MBUF_CLASSES];
+    unsigned int        c, i;
+
+    bzero(nb_class, sizeof(nb_class));
+    for (i = 0; i < nb; i++) {
+        if (multi_segs && pcap->pkts[cpt + i].len > MBUF_SEG_SZ) {
+            bulk[i] = alloc_pkt_chain(pools[get_mbuf_class(MBUF_SEG_SZ)],
+                                      pcap->pkts[cpt + i].len);
+            if (!bulk[i]) {
+                fprintf(stderr, "\n%s: alloc of a mbufs chain failed. exiting.\n",
+                        __FUNCTION__);
+                free_pkt_chains(pcap, bulk, cpt, i);
+                return (ENOMEM);
+            }
+        } else
+            nb_class[get_mbuf_class(pcap->pkts[cpt + i].len)]++;
+    }
+    for (c = 0; c < NB_MBUF_CLASSES; c++) {
+        if (nb_class[c] && rte_pktmbuf_alloc_bulk(pools[c], classes[c], nb_class[c])) {
+            fprintf(stderr, "\n%s: rte_pktmbuf_alloc_bulk failed. exiting.\n",
+                    __FUNCTION__);
+            /* give back the mbufs of the previous classes */
+            while (c-- > 0)
+                for (i = 0; i < nb_class[c]; i++)
+                    rte_pktmbuf_free(classes[c][i]);
+            if (multi_segs)
+                free_pkt_chains(pcap, bulk, cpt, nb);
+            return (ENOMEM);
+        }
+    }
+    for (i = nb; i-- > 0; ) {
+        if (multi_segs && pcap->pkts[cpt + i].len > MBUF_SEG_SZ)
+            continue;
+        c = get_mbuf_class(pcap->pkts[cpt + i].len);
+        bulk[i] = classes[c][--nb_class[c]];
+    }
+    return (0);
+}
+
+/* shared cache and zero copy modes: store a burst of pkts in the numacore copy */
+static int load_shared_burst(const struct load_ctx* ctx, const int numa,
+                             const unsigned int cpt, const unsigned int nb)
+{
+    const struct pcap_ctx*  pcap = ctx->pcap;
+    struct rte_mbuf*        bulk[BURST_SZ];
+    uint64_t                first, last;
+    unsigned int            i;
+
+    /* zero copy: copy the burst of packets as is in the pcap image */
+    if (ctx->images) {
+        first = pcap->pkts[cpt].offset;
+        last = pcap->pkts[cpt + nb - 1].offset + pcap->pkts[cpt + nb - 1].len;
+        rte_memcpy((char*)ctx->images[numa]->addr + first, pcap->map + first,
+                   last - first);
+        return (attach_pkts_to_caches(ctx, NULL, numa, cpt, nb));
+    }
+
+    if (alloc_pkts_bulk(pcap, ctx->pools[numa], bulk, cpt, nb, ctx->multi_segs))
+        return (ENOMEM);
+    for (i = 0; i < nb; i++)
+        copy_pkt_to_mbuf(bulk[i], pcap->map + pcap->pkts[cpt + i].offset,
+                         pcap->pkts[cpt + i].len);
+    return (attach_pkts_to_caches(ctx, bulk, numa, cpt, nb));
+}
+
+/* fill the caches from a slice of the packets index */
+static int load_job(struct load_ctx* ctx)
+{
+    const struct pcap_ctx*  pcap = ctx->pcap;
+    struct rte_mbuf*        bulk[BURST_SZ];
+    unsigned int            cpt, nb, end, i;
+    int                     numa, ret = 0;
+
+    /*
+      when the lcore owns its cache, alloc it from the lcore, so its pages
+      are local to it
+    */
+    if (!ctx->caches->mbufs) {
+        ctx->caches->mbufs = malloc(sizeof(*(ctx->caches->mbufs)) * pcap->nb_pkts);
+        if (ctx->caches->mbufs == NULL) {
+            fprintf(stderr, "%s: malloc of mbufs failed.\n", __FUNCTION__);
+            ret = ENOMEM;
+            goto load_threadExit;
+        }
+        bzero(ctx->caches->mbufs, sizeof(*(ctx->caches->mbufs)) * pcap->nb_pkts);
+    }
+
+    end = ctx->first_pkt + ctx->nb_pkts;
+    for (cpt = ctx->first_pkt; cpt < end; cpt += nb) {
+        nb = min(BURST_SZ, end - cpt);
+
+        if (ctx->indirect_pools) {
+            /* once per numacore with ports */
+            for (numa = 0; numa < MAX_NUMA_NODES && !ret; numa++)
+                if (ctx->indirect_pools[numa])
+                    ret = load_shared_burst(ctx, numa, cpt, nb);
+        } else {
+            ret = alloc_pkts_bulk(pcap, ctx->pool, bulk, cpt, nb, ctx->multi_segs);
+            if (ret)
+                goto load_threadExit;
+            for (i = 0; i < nb; i++)
+                copy_pkt_to_mbuf(bulk[i], pcap->map + pcap->pkts[cpt + i].offset,
+                                 pcap->pkts[cpt + i].len);
+            for (i = 0; i < nb && !ret; i++) {
+                stamp_pkt(ctx, bulk[i], 0, cpt + i);
+                ret = add_pkt_to_cache(ctx->caches, bulk[i], cpt + i, ctx->nbruns);
+            }
+        }
+        if (ret) {
+            fprintf(stderr, "\nadd_pkt_to_cache failed on pkt.\n");
+            goto load_threadExit;
+        }
+        ctx->cpt = cpt + nb - ctx->first_pkt;
+    }
+
+load_threadExit:
+    ctx->ret = ret;
+    ctx->done = 1;
+    return (ret);
+}
+
+/* lcore function: do the loading jobs of the lcore, stopping on error */
+static int load_thread(void* arg)
+{
+    struct load_ctx*    ctx;
+    int                 ret = 0;
+
+    for (ctx = arg; ctx; ctx = ctx->next) {
+        if (!ret)
+            ret = load_job(ctx);
+        else {
+            ctx->ret = ret;
+            ctx->done = 1;
+        }
+    }
+    return (ret);
+}
+
+static int map_pcap(const struct cmd_opts* opts, struct pcap_ctx* pcap)
+{
+    struct stat     s;
 
     /* open wanted file */
     pcap->fd = open(opts->trace, O_RDONLY);
     if (pcap->fd < 0) {
         printf("open of %s failed: %s\n", opts->trace, strerror(errno));
+        pcap->fd = 0;
         return (errno);
     }
 
-    /* check pcap header */
-    ret = check_pcap_hdr(pcap->fd);
+    /* get file informations */
+    if (fstat(pcap->fd, &s)) {
+        printf("fstat of %s failed: %s\n", opts->trace, strerror(errno));
+        return (errno);
+    }
+    if ((size_t)s.st_size < sizeof(pcap_hdr_t)) {
+        printf("%s is too small to be a pcap file.\n", opts->trace);
+        return (EPROTO);
+    }
+    pcap->map_sz = s.st_size;
+
+    /* map the whole file, the kernel does the readahead for us */
+    pcap->map = mmap(NULL, pcap->map_sz, PROT_READ, MAP_PRIVATE, pcap->fd, 0);
+    if (pcap->map == MAP_FAILED) {
+        printf("mmap of %s failed: %s\n", opts->trace, strerror(errno));
+        pcap->map = NULL;
+        return (errno);
+    }
+    /* only hints: errors are not fatal */
+    madvise(pcap->map, pcap->map_sz, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(pcap->map, pcap->map_sz, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+    return (0);
+}
+
+int preload_pcap(const struct cmd_opts* opts, struct pcap_ctx* pcap)
+{
+    const pcaprec_hdr_t*    pcap_rechdr;
+    struct pcap_pkt*        pkts;
+    uint64_t*               ipg;
+    uint64_t                ts, prev_ts, ts_res;
+    unsigned int            cpt, index_sz, class, nb_segs;
+    size_t                  pos;
+    float                   percent;
+    int                     ret;
+
+    if (!opts || !pcap)
+        return (EINVAL);
+
+    ret = map_pcap(opts, pcap);
     if (ret)
         goto preload_pcapErrorInit;
 
-    /* get file informations */
-    ret = stat(opts->trace, &s);
+    /* check pcap header */
+    ret = check_pcap_hdr((const pcap_hdr_t*)pcap->map);
     if (ret)
         goto preload_pcapErrorInit;
-    s.st_size -= sizeof(pcap_hdr_t);
-    printf("preloading %s file (of size: %li bytes)\n", opts->trace, s.st_size);
-    pcap->cap_sz = s.st_size;
 
-    /* loop on file to read all saved packets */
-    for (total_read = 0, cpt = 0; ; cpt++) {
+    /* timestamps sub-second part unit, in ns */
+    ts_res = (((const pcap_hdr_t*)pcap->map)->magic_number == PCAP_NSEC_MAGIC ? 1 : 1000);
+
+    pcap->cap_sz = pcap->map_sz - sizeof(pcap_hdr_t);
+    printf("preloading %s file (of size: %lu bytes)\n", opts->trace, pcap->cap_sz);
+
+    /* walk on the mapped file to index all saved packets */
+    for (pos = sizeof(pcap_hdr_t), cpt = index_sz = 0, prev_ts = 0;
+         pos < pcap->map_sz; cpt++) {
         /* get packet pcap header */
-        nb_read = read(pcap->fd, &pcap_rechdr, sizeof(pcap_rechdr));
-        if (!nb_read) /* EOF :) */
-            break;
-        else if (nb_read == (unsigned long)(-1)) {
-            printf("\n%s: read failed (%s)\n", __FUNCTION__, strerror(errno));
-            ret = errno;
-            goto preload_pcapError;
-        } else if (nb_read != sizeof(pcap_rechdr)) {
+        if (pos + sizeof(*pcap_rechdr) > pcap->map_sz) {
             printf("\nread pkt hdr misssize: %lu / %lu\n",
-                   nb_read, sizeof(pcap_rechdr));
-            goto preload_pcapError;
+                   pcap->map_sz - pos, sizeof(*pcap_rechdr));
+            break;
         }
-        total_read += nb_read;
+        pcap_rechdr = (const pcaprec_hdr_t*)(pcap->map + pos);
+        pos += sizeof(*pcap_rechdr);
 
 #ifdef DEBUG
-        if (pcap_rechdr.incl_len != pcap_rechdr.orig_len)
+        if (pcap_rechdr->incl_len != pcap_rechdr->orig_len)
             printf("\npkt %i size: %u/%u\n", cpt,
-                   pcap_rechdr.incl_len, pcap_rechdr.orig_len);
+                   pcap_rechdr->incl_len, pcap_rechdr->orig_len);
 #endif /* DEBUG */
 
-        /* update max pkt size (to be able to calculate the needed memory) */
-        if (pcap_rechdr.incl_len > pcap->max_pkt_sz)
-            pcap->max_pkt_sz = pcap_rechdr.incl_len;
-
-        /* get packet */
-        nb_read = read(pcap->fd, pkt_buf, pcap_rechdr.incl_len);
-        if (nb_read == (unsigned long)(-1)) {
-            printf("\n%s: read failed (%s)\n", __FUNCTION__, strerror(errno));
-            ret = errno;
-            goto preload_pcapError;
-        } else if (nb_read != pcap_rechdr.incl_len) {
+        /* check that the packet is entirely in the file */
+        if (pos + pcap_rechdr->incl_len > pcap->map_sz) {
             printf("\nread pkt %i payload misssize: %u / %u\n", cpt,
-                   (unsigned int)nb_read, pcap_rechdr.incl_len);
-            goto preload_pcapError;
+                   (unsigned int)(pcap->map_sz - pos), pcap_rechdr->incl_len);
+            pos -= sizeof(*pcap_rechdr);
+            break;
+        }
+
+        /* update max pkt sizes (to be able to calculate the needed memory) */
+        if (pcap_rechdr->incl_len > pcap->max_pkt_sz)
+            pcap->max_pkt_sz = pcap_rechdr->incl_len;
+        if (opts->multi_segs && pcap_rechdr->incl_len > MBUF_SEG_SZ) {
+            /* a chain of segments of MBUF_SEG_SZ */
+            nb_segs = (pcap_rechdr->incl_len + MBUF_SEG_SZ - 1) / MBUF_SEG_SZ;
+            class = get_mbuf_class(MBUF_SEG_SZ);
+            pcap->class_max_sz[class] = MBUF_SEG_SZ;
+        } else {
+            nb_segs = 1;
+            class = get_mbuf_class(pcap_rechdr->incl_len);
+            if (pcap_rechdr->incl_len > pcap->class_max_sz[class])
+                pcap->class_max_sz[class] = pcap_rechdr->incl_len;
+        }
+        pcap->class_pkts[class] += nb_segs;
+        pcap->nb_segs += nb_segs;
+
+        /* add packet to the index, growing it by doubling its size */
+        if (cpt == index_sz) {
+            index_sz = (index_sz ? index_sz * 2 : PCAP_INDEX_INIT_SZ);
+            pkts = myrealloc(pcap->pkts, sizeof(*pkts) * index_sz);
+            if (!pkts) {
+                printf("\n%s: realloc of packets index failed.\n", __FUNCTION__);
+                pcap->pkts = NULL;
+                ret = ENOMEM;
+                break;
+            }
+            pcap->pkts = pkts;
+            if (opts->normalspeed) {
+                ipg = myrealloc(pcap->ipg, sizeof(*ipg) * index_sz);
+                if (!ipg) {
+                    printf("\n%s: realloc of inter packet gaps failed.\n", __FUNCTION__);
+                    pcap->ipg = NULL;
+                    ret = ENOMEM;
+                    break;
+                }
+                pcap->ipg = ipg;
+            }
+        }
+        pcap->pkts[cpt].offset = pos;
+        pcap->pkts[cpt].len = pcap_rechdr->incl_len;
+
+        /* keep the gap from the previous packet, if we need it */
+        if (opts->normalspeed) {
+            ts = pcap_rechdr->ts_sec * 1000000000UL + pcap_rechdr->ts_usec * ts_res;
+            /* the first packet of a run is sent right after the last one */
+            pcap->ipg[cpt] = ((cpt && ts > prev_ts) ? ts - prev_ts : 0);
+            prev_ts = ts;
         }
-        total_read += nb_read;
+        pos += pcap_rechdr->incl_len;
 
         /* calcul & print progression every 1024 pkts */
         if ((cpt % 1024) == 0) {
-            percent = 100 * (float)total_read / (float)s.st_size;
+            percent = 100 * (float)(pos - sizeof(pcap_hdr_t)) / (float)pcap->cap_sz;
             printf("\rfile read at %02.2f%%", percent);
         }
     }
 
-preload_pcapError:
-    percent = 100 * (float)total_read / (float)s.st_size;
+    percent = 100 * (float)(pos - sizeof(pcap_hdr_t)) / (float)pcap->cap_sz;
     printf("%sfile read at %02.2f%%\n", (ret ? "\n" : "\r"), percent);
-    printf("read %u pkts (for a total of %li bytes). max paket length = %u bytes.\n",
-           cpt, total_read, pcap->max_pkt_sz);
+    printf("read %u pkts (for a total of %lu bytes). max paket length = %u bytes.\n",
+           cpt, pos - sizeof(pcap_hdr_t), pcap->max_pkt_sz);
 preload_pcapErrorInit:
-    if (ret) {
-        close(pcap->fd);
-        pcap->fd = 0;
-    } else
+    if (ret)
+        clean_pcap_ctx(pcap);
+    else
         pcap->nb_pkts = cpt;
     return (ret);
 }
@@ -195,102 +574,197 @@ preload_pcapErrorInit:
 int load_pcap(const struct cmd_opts* opts, struct pcap_ctx* pcap,
               const struct cpus_bindings* cpus, struct dpdk_ctx* dpdk)
 {
-    pcaprec_hdr_t   pcap_rechdr;
-    unsigned char   pkt_buf[MAX_PKT_SZ];
-    unsigned int    cpt = 0;
-    size_t          nb_read;
-    long int        total_read = 0;
-    float           percent;
-    unsigned int    i;
-    int             ret;
+    struct load_ctx*    ctx;
+    uint64_t*           ts_ns = NULL;
+    unsigned long       cpt, total;
+    unsigned int        i, j, nb_done, nb_jobs, port, shard;
+    double              tsc_per_ns, ts;
+    float               percent;
+    char                name[RTE_MEMZONE_NAMESIZE];
+    int                 n, ret = 0;
 
     if (!opts || !pcap || !cpus || !dpdk)
         return (EINVAL);
 
     /* alloc needed pkt caches and bzero them */
-    dpdk->pcap_caches = malloc(sizeof(*(dpdk->pcap_caches)) * (cpus->nb_needed_cpus));
+    dpdk->pcap_caches = malloc(sizeof(*(dpdk->pcap_caches)) * (cpus->nb_ports));
     if (!dpdk->pcap_caches) {
         printf("malloc of pcap_caches failed.\n");
         return (ENOMEM);
     }
-    bzero(dpdk->pcap_caches, sizeof(*(dpdk->pcap_caches)) * (cpus->nb_needed_cpus));
-    for (i = 0; i < cpus->nb_needed_cpus; i++) {
-        dpdk->pcap_caches[i].mbufs = malloc(sizeof(*(dpdk->pcap_caches[i].mbufs)) *
-                                            pcap->nb_pkts);
-        if (dpdk->pcap_caches[i].mbufs == NULL) {
-            fprintf(stderr, "%s: malloc of mbufs failed.\n", __FUNCTION__);
+    bzero(dpdk->pcap_caches, sizeof(*(dpdk->pcap_caches)) * (cpus->nb_ports));
+    ctx = malloc(sizeof(*ctx) * cpus->nb_tasks);
+    if (!ctx) {
+        printf("malloc of load contexts failed.\n");
+        return (ENOMEM);
+    }
+    bzero(ctx, sizeof(*ctx) * cpus->nb_tasks);
+
+    /* in zero copy mode, reserve the hugepages memzone of each numacore pcap image */
+    for (n = 0; dpdk->image_sz && n < MAX_NUMA_NODES; n++) {
+        if (!cpus->numa_ports[n])
+            continue;
+        snprintf(name, sizeof(name), "dpdk_replay_pcap_image_%i", n);
+        dpdk->images[n] = rte_memzone_reserve_aligned(name,
+                                                      dpdk->image_sz,
+                                                      n,
+                                                      RTE_MEMZONE_1GB |
+                                                      RTE_MEMZONE_SIZE_HINT_ONLY |
+                                                      RTE_MEMZONE_IOVA_CONTIG,
+                                                      RTE_CACHE_LINE_SIZE);
+        if (!dpdk->images[n]) {
+            fprintf(stderr, "%s: reserve of %lu bytes for the pcap image on numacore %i"
+                    " failed (%s).\n"
+                    "The image must be IOVA contiguous: use IOVA as VA mode or"
+                    " hugepages big enough.\n",
+                    __FUNCTION__, dpdk->image_sz, n, rte_strerror(rte_errno));
+            free(ctx);
             return (ENOMEM);
         }
-        bzero(dpdk->pcap_caches[i].mbufs,
-              sizeof(*(dpdk->pcap_caches[i].mbufs)) * pcap->nb_pkts);
-    }
-
-    /* seek again to the beginning */
-    if (lseek(pcap->fd, 0, SEEK_SET) == (off_t)(-1)) {
-        printf("%s: lseek failed (%s)\n", __FUNCTION__, strerror(errno));
-        ret = errno;
-        goto load_pcapError;
+#if API_AT_LEAST_AS_RECENT_AS(18, 05)
+        if (init_image_shinfos(dpdk, pcap, cpus->nb_ports, cpus->numa_ports[n], n)) {
+            fprintf(stderr, "%s: malloc of the image refcnts failed.\n", __FUNCTION__);
+            free(ctx);
+            return (ENOMEM);
+        }
+#endif /* API_AT_LEAST_AS_RECENT_AS(18, 05) */
     }
-    ret = check_pcap_hdr(pcap->fd);
-    if (ret)
-        goto load_pcapError;
 
-    printf("-> Will cache %i pkts on %i caches.\n", pcap->nb_pkts, cpus->nb_needed_cpus);
-    for (; cpt < pcap->nb_pkts; cpt++) {
-        /* get packet pcap header */
-        nb_read = read(pcap->fd, &pcap_rechdr, sizeof(pcap_rechdr));
-        if (!nb_read) /* EOF :) */
-            break;
-        else if (nb_read == (unsigned long)(-1)) {
-            printf("\n%s: read failed (%s)\n", __FUNCTION__, strerror(errno));
-            ret = errno;
-            goto load_pcapError;
-        } else if (nb_read != sizeof(pcap_rechdr)) {
-            printf("\nread pkt hdr misssize: %u / %lu\n",
-                   (unsigned int)nb_read, sizeof(pcap_rechdr));
-            ret = EIO;
-            goto load_pcapError;
+    /*
+      in shared cache and zero copy modes, every lcore fills a slice of all
+      the caches, else each lcore fills the slice of its port cache that it
+      will send (the whole cache with one core per port).
+    */
+    if (dpdk->nb_indirect_mbuf || cpus->cores_per_port > 1) {
+        for (i = 0; i < cpus->nb_ports; i++) {
+            dpdk->pcap_caches[i].mbufs = malloc(sizeof(*(dpdk->pcap_caches[i].mbufs)) *
+                                                pcap->nb_pkts);
+            if (dpdk->pcap_caches[i].mbufs == NULL) {
+                fprintf(stderr, "%s: malloc of mbufs failed.\n", __FUNCTION__);
+                free(ctx);
+                return (ENOMEM);
+            }
         }
-        total_read += nb_read;
-
-        /* get packet */
-        nb_read = read(pcap->fd, pkt_buf, pcap_rechdr.incl_len);
-        if (nb_read == (unsigned long)(-1)) {
-            printf("\n%s: read failed (%s)\n", __FUNCTION__, strerror(errno));
-            ret = errno;
-            goto load_pcapError;
-        } else if (nb_read != pcap_rechdr.incl_len) {
-            printf("\nread pkt %u payload misssize: %u / %u\n", cpt,
-                   (unsigned int)nb_read, pcap_rechdr.incl_len);
-            ret = EIO;
-            goto load_pcapError;
+    }
+    if (dpdk->nb_indirect_mbuf) {
+        for (nb_jobs = cpus->nb_needed_cpus, i = 0; i < nb_jobs; i++) {
+            ctx[i].lcore = i;
+            ctx[i].caches = dpdk->pcap_caches;
+            ctx[i].nb_caches = cpus->nb_ports;
+            ctx[i].first_pkt = (unsigned long)pcap->nb_pkts * i / cpus->nb_needed_cpus;
+            ctx[i].nb_pkts = (unsigned long)pcap->nb_pkts * (i + 1) / cpus->nb_needed_cpus
+                - ctx[i].first_pkt;
+            ctx[i].pools = dpdk->pktmbuf_pools;
+            ctx[i].indirect_pools = dpdk->indirect_pools;
+            ctx[i].images = (dpdk->image_sz ? dpdk->images : NULL);
+            ctx[i].image_shinfos = dpdk->image_shinfos;
+            ctx[i].cache_numa = cpus->port_numa;
+            ctx[i].ts_ratio = dpdk->ts_ratio;
         }
-        total_read += nb_read;
-
-        /* add packet to caches */
-        for (i = 0; i < cpus->nb_needed_cpus; i++) {
-            ret = add_pkt_to_cache(dpdk, i, pkt_buf, nb_read, cpt, opts->nbruns);
-            if (ret) {
-                fprintf(stderr, "\nadd_pkt_to_cache failed on pkt.\n");
-                goto load_pcapError;
-            }
+    } else {
+        /* the tasks sharing a lcore are loaded one after the other */
+        for (nb_jobs = cpus->nb_tasks, i = 0; i < nb_jobs; i++) {
+            ctx[i].lcore = cpus->task_lcore[i];
+            for (j = i + 1; j < nb_jobs && cpus->task_lcore[j] != ctx[i].lcore; j++) ;
+            ctx[i].next = (j < nb_jobs ? &(ctx[j]) : NULL);
+            port = i / cpus->cores_per_port;
+            shard = i % cpus->cores_per_port;
+            ctx[i].caches = &(dpdk->pcap_caches[port]);
+            ctx[i].nb_caches = 1;
+            ctx[i].pool = dpdk->pktmbuf_pools[cpus->port_numa[port]];
+            if (dpdk->tx_ts)
+                ctx[i].ts_ratio = &(dpdk->ts_ratio[port]);
+            ctx[i].first_pkt = (unsigned long)pcap->nb_pkts * shard / cpus->cores_per_port;
+            ctx[i].nb_pkts = (unsigned long)pcap->nb_pkts * (shard + 1) / cpus->cores_per_port
+                - ctx[i].first_pkt;
         }
+    }
 
-        /* calcul & print progression every 1024 pkts */
-        if ((cpt % 1024) == 0) {
-            percent = 100 * cpt / pcap->nb_pkts;
-            printf("\rfile read at %02.2f%%", percent);
+    /* tx timestamp offload: time of each pkt from the run start, at the wanted speed */
+    if (dpdk->tx_ts) {
+        ts_ns = malloc(sizeof(*ts_ns) * pcap->nb_pkts);
+        if (!ts_ns) {
+            fprintf(stderr, "%s: malloc of timestamps failed.\n", __FUNCTION__);
+            free(ctx);
+            return (ENOMEM);
+        }
+        for (i = 0, ts = 0; i < pcap->nb_pkts; i++) {
+            ts += pcap->ipg[i] / opts->speed;
+            ts_ns[i] = ts;
         }
     }
 
-load_pcapError:
-    percent = 100 * cpt / pcap->nb_pkts;
-    printf("%sfile read at %02.2f%%\n", (ret ? "\n" : "\r"), percent);
-    if (ret)
-        printf("read %u pkts (for a total of %li bytes).\n", cpt, total_read);
-    dpdk->pcap_sz = total_read;
-    close(pcap->fd);
-    pcap->fd = 0;
+    /* the tx threads re-arm the refcnt of the mbufs for longer replays */
+    dpdk->armed_runs = ((opts->loop_forever || opts->duration ||
+                         opts->nbruns > MBUF_REFCNT_ARM) ? MBUF_REFCNT_ARM : opts->nbruns);
+
+    /* fill caches from the tx lcores */
+    printf("-> Will cache %i pkts on %i caches%s.\n", pcap->nb_pkts,
+           cpus->nb_ports,
+           (dpdk->image_sz ? " (zero copy)" : (dpdk->nb_indirect_mbuf ? " (shared)" : "")));
+    for (i = 0, total = 0; i < nb_jobs; i++) {
+        ctx[i].pcap = pcap;
+        ctx[i].nbruns = dpdk->armed_runs;
+        ctx[i].multi_segs = opts->multi_segs;
+        ctx[i].ts_ns = ts_ns;
+        ctx[i].ts_offset = dpdk->ts_offset;
+        ctx[i].ts_flag = dpdk->ts_flag;
+        total += ctx[i].nb_pkts;
+    }
+    for (i = 0; i < cpus->nb_needed_cpus; i++) {
+        /* first job of the lcore */
+        for (j = 0; ctx[j].lcore != i; j++) ;
+        /* skip the fake master core, lcore 0 */
+        ret = rte_eal_remote_launch(load_thread, &(ctx[j]), i + 1);
+        if (ret) {
+            fprintf(stderr, "rte_eal_remote_launch failed: %s\n", strerror(-ret));
+            break;
+        }
+    }
+    /* the jobs of the lcores not launched will never be done */
+    for (j = 0; j < nb_jobs; j++)
+        if (ctx[j].lcore >= i)
+            ctx[j].done = 1;
+
+    /* print progression until all launched threads are done */
+    do {
+        usleep(100000);
+        for (j = 0, cpt = 0, nb_done = 0; j < nb_jobs; j++) {
+            cpt += ctx[j].cpt;
+            nb_done += ctx[j].done;
+        }
+        percent = (total ? 100 * (float)cpt / (float)total : 100);
+        printf("\rfile cached at %02.2f%%", percent);
+        fflush(stdout);
+    } while (nb_done < nb_jobs);
+    rte_eal_mp_wait_lcore();
+    putchar('\n');
+
+    /* get back threads results */
+    for (i = 0; i < nb_jobs && !ret; i++)
+        ret = ctx[i].ret;
+    free(ctx);
+#if defined(DEBUG) && API_AT_LEAST_AS_RECENT_AS(20, 11)
+    if (ts_ns && !ret)
+        for (i = 0; i < min(pcap->nb_pkts, 4); i++)
+            printf("pkt %u: timestamp dynfield %lu on port 0\n", i,
+                   *RTE_MBUF_DYNFIELD(dpdk->pcap_caches[0].mbufs[i], dpdk->ts_offset,
+                                      uint64_t*));
+#endif /* DEBUG && API_AT_LEAST_AS_RECENT_AS(20, 11) */
+    free(ts_ns);
+    for (i = 0, dpdk->pcap_sz = 0; i < pcap->nb_pkts; i++)
+        dpdk->pcap_sz += pcap->pkts[i].len;
+
+    /* convert the gaps to tsc cycles, at the wanted speed */
+    if (pcap->ipg) {
+        tsc_per_ns = (double)rte_get_tsc_hz() / 1000000000 / opts->speed;
+        for (i = 0, pcap->ipg_sum = 0; i < pcap->nb_pkts; i++) {
+            pcap->ipg[i] = pcap->ipg[i] * tsc_per_ns;
+            pcap->ipg_sum += pcap->ipg[i];
+        }
+        printf("-> One run will last %f sec (speed x%g).\n",
+               (double)pcap->ipg_sum / rte_get_tsc_hz(), opts->speed);
+    }
     return (ret);
 }
 
@@ -299,9 +773,23 @@ void clean_pcap_ctx(struct pcap_ctx* pcap)
     if (!pcap)
         return ;
 
+    if (pcap->map) {
+        munmap(pcap->map, pcap->map_sz);
+        pcap->map = NULL;
+    }
     if (pcap->fd) {
         close(pcap->fd);
         pcap->fd = 0;
     }
+    if (pcap->pkts) {
+        free(pcap->pkts);
+        pcap->pkts = NULL;
+    }
+    if (pcap->ipg) {
+        free(pcap->ipg);
+        pcap->ipg = NULL;
+    }
+    free(pcap->rw_pkts);
+    pcap->rw_pkts = NULL;
     return ;
 }
@@ -0,0 +1,253 @@
+/*
+  SPDX-License-Identifier: BSD-3-Clause
+  Copyright 2018 Jonathan Ribas, FraudBuster. All rights reserved.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <rte_version.h>
+#include <rte_cycles.h>
+
+#include "main.h"
+
+/*
+  Machine readable results (see --results): the configuration, the results of
+  each tx thread and the totals, in JSON or in CSV, on stdout or in a file, so
+  that scripts don't have to parse the "RESULTS :" output.
+*/
+
+/* parse --results json|csv[:FILE] */
+int str_to_results(struct cmd_opts* opts, char* arg)
+{
+    char*   file;
+
+    if (!opts || !arg)
+        return (EINVAL);
+
+    file = strchr(arg, ':');
+    if (file)
+        *file++ = '\0';
+    if (!strcmp(arg, "json"))
+        opts->results_fmt = RESULTS_JSON;
+    else if (!strcmp(arg, "csv"))
+        opts->results_fmt = RESULTS_CSV;
+    else {
+        printf("--results: unknown format %s.\n", arg);
+        return (EPROTO);
+    }
+    opts->results_file = (file && *file ? file : NULL);
+    return (0);
+}
+
+static void json_str(FILE* f, const char* s)
+{
+    fputc('"', f);
+    for (; s && *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+    return ;
+}
+
+/* what a task sent, and its rates in decimal units */
+struct                  task_result {
+    uint64_t            sent;
+    uint64_t            sent_sz;
+    double              pps;
+    double              gbps; /* L2 */
+    double              wire_gbps;
+};
+
+static void get_task_result(const struct thread_ctx* ctx, struct task_result* res)
+{
+    res->sent = ctx->total_pkt - ctx->total_drop;
+    res->sent_sz = ctx->total_pkt_sz - ctx->total_drop_sz;
+    res->pps = res->gbps = res->wire_gbps = 0;
+    if (!ctx->duration)
+        return ;
+    res->pps = res->sent / ctx->duration;
+    res->gbps = res->sent_sz / ctx->duration * 8 / 1000 / 1000 / 1000;
+    res->wire_gbps = (ctx->total_wire_sz - ctx->total_drop_wire_sz) / ctx->duration
+        * 8 / 1000 / 1000 / 1000;
+    return ;
+}
+
+/*
+  Cycles spent per packet by the lcore of a task: its tasks are busy polling
+  during the replay, so these are all its cycles over all the pkts it sent.
+*/
+double get_cycles_per_pkt(const struct cpus_bindings* cpus, const struct thread_ctx* ctx,
+                          const unsigned int task)
+{
+    uint64_t        sent;
+    unsigned int    i;
+
+    for (i = 0, sent = 0; i < cpus->nb_tasks; i++)
+        if (cpus->task_lcore[i] == cpus->task_lcore[task])
+            sent += ctx[i].total_pkt - ctx[i].total_drop;
+    if (!sent)
+        return (0);
+    return (ctx[task].duration * rte_get_tsc_hz() / sent);
+}
+
+static void write_json(FILE* f, const struct cmd_opts* opts,
+                       const struct cpus_bindings* cpus, const struct thread_ctx* ctx)
+{
+    struct task_result  res;
+    uint64_t            total_pkt, total_drop;
+    double              total_pps, total_gbps, total_wire_gbps, port_gbps, port_wire_gbps;
+    unsigned int        i, link_speed;
+    int                 p;
+
+    fputs("{\n  \"config\": {\n    \"trace\": ", f);
+    json_str(f, opts->trace);
+    fputs(",\n    \"ports\": [", f);
+    for (p = 0; p < opts->nb_pcicards; p++) {
+        fputs(p ? ", " : "", f);
+        json_str(f, opts->pcicards[p]);
+    }
+    fputs("],\n    \"dpdk\": ", f);
+    json_str(f, rte_version());
+    fprintf(f, ",\n    \"nbruns\": %i,\n    \"loop_forever\": %i,\n    \"duration\": %f,\n"
+            "    \"cores_per_port\": %u,\n    \"maxbitrate\": %f,\n    \"maxpps\": %f,\n"
+            "    \"speed\": %f,\n    \"lossless\": %i,\n    \"tx_queues\": %u,\n"
+            "    \"tx_desc\": %u,\n    \"burst\": %u,\n    \"stream\": %i,\n"
+            "    \"shared_cache\": %i,\n    \"zero_copy\": %i\n  },\n  \"threads\": [",
+            opts->nbruns, opts->loop_forever, opts->duration, cpus->cores_per_port,
+            opts->maxbitrate, opts->maxpps, opts->normalspeed ? opts->speed : 0,
+            opts->lossless, opts->tx_queues, opts->tx_desc, opts->burst_sz,
+            opts->stream, opts->shared_cache, opts->zero_copy);
+
+    total_pps = total_gbps = total_wire_gbps = 0;
+    total_pkt = total_drop = 0;
+    for (i = 0; i < cpus->nb_tasks; i++) {
+        get_task_result(&(ctx[i]), &res);
+        total_pps += res.pps;
+        total_gbps += res.gbps;
+        total_wire_gbps += res.wire_gbps;
+        total_pkt += ctx[i].total_pkt;
+        total_drop += ctx[i].total_drop;
+        fprintf(f, "%s\n    {\"thread\": %u, \"port\": %i, \"lcore\": %u, \"duration\": %f,"
+                " \"pkts\": %lu, \"sent\": %lu, \"sent_bytes\": %lu, \"dropped\": %lu,"
+                " \"pps\": %f, \"gbps\": %f, \"wire_gbps\": %f, \"cycles_per_pkt\": %f}",
+                i ? "," : "", i, ctx[i].tx_port_id,
+                cpus->cpus_to_use[cpus->task_lcore[i] + 1], ctx[i].duration,
+                ctx[i].total_pkt, res.sent, res.sent_sz, ctx[i].total_drop, res.pps,
+                res.gbps, res.wire_gbps, get_cycles_per_pkt(cpus, ctx, i));
+    }
+
+    /* the tasks of a port follow each other */
+    fputs("\n  ],\n  \"ports\": [", f);
+    for (p = 0; p < (int)cpus->nb_ports; p++) {
+        port_gbps = port_wire_gbps = 0;
+        for (i = p * cpus->cores_per_port; i < (p + 1) * cpus->cores_per_port; i++) {
+            get_task_result(&(ctx[i]), &res);
+            port_gbps += res.gbps;
+            port_wire_gbps += res.wire_gbps;
+        }
+        link_speed = get_link_speed(p);
+        fprintf(f, "%s\n    {\"port\": %i, \"gbps\": %f, \"wire_gbps\": %f,"
+                " \"link_mbps\": %u, \"line_rate_pct\": ", p ? "," : "", p,
+                port_gbps, port_wire_gbps, link_speed);
+        if (link_speed)
+            fprintf(f, "%f}", port_wire_gbps * 1000 * 100 / link_speed);
+        else
+            fputs("null}", f);
+    }
+    fprintf(f, "\n  ],\n  \"total\": {\"pkts\": %lu, \"dropped\": %lu, \"drop_pct\": %f,"
+            " \"pps\": %f, \"gbps\": %f, \"wire_gbps\": %f}\n}\n", total_pkt, total_drop,
+            total_pkt ? (double)total_drop * 100 / total_pkt : 0, total_pps, total_gbps,
+            total_wire_gbps);
+    return ;
+}
+
+/*
+  The configuration goes in a '#' comment line, before the header. The
+  line_rate_pct of a thread is its share of the link speed of its port.
+*/
+static void write_csv(FILE* f, const struct cmd_opts* opts,
+                      const struct cpus_bindings* cpus, const struct thread_ctx* ctx)
+{
+    struct task_result  res;
+    uint64_t            total_pkt, total_sent, total_sent_sz, total_drop;
+    double              total_pps, total_gbps, total_wire_gbps, duration;
+    unsigned int        i, link_speed;
+
+    fprintf(f, "# trace=%s dpdk=%s nbruns=%i loop_forever=%i duration=%f"
+            " cores_per_port=%u maxbitrate=%f maxpps=%f speed=%f lossless=%i"
+            " tx_queues=%u tx_desc=%u burst=%u stream=%i shared_cache=%i zero_copy=%i\n",
+            opts->trace, rte_version(), opts->nbruns, opts->loop_forever, opts->duration,
+            cpus->cores_per_port, opts->maxbitrate, opts->maxpps,
+            opts->normalspeed ? opts->speed : 0, opts->lossless, opts->tx_queues,
+            opts->tx_desc, opts->burst_sz, opts->stream, opts->shared_cache,
+            opts->zero_copy);
+    fputs("thread,port,pci,lcore,duration,pkts,sent,sent_bytes,dropped,pps,gbps,"
+          "wire_gbps,cycles_per_pkt,line_rate_pct\n", f);
+
+    total_pps = total_gbps = total_wire_gbps = duration = 0;
+    total_pkt = total_sent = total_sent_sz = total_drop = 0;
+    for (i = 0; i < cpus->nb_tasks; i++) {
+        get_task_result(&(ctx[i]), &res);
+        total_pps += res.pps;
+        total_gbps += res.gbps;
+        total_wire_gbps += res.wire_gbps;
+        total_pkt += ctx[i].total_pkt;
+        total_sent += res.sent;
+        total_sent_sz += res.sent_sz;
+        total_drop += ctx[i].total_drop;
+        duration = max(duration, ctx[i].duration);
+        fprintf(f, "%u,%i,%s,%u,%f,%lu,%lu,%lu,%lu,%f,%f,%f,%f,", i, ctx[i].tx_port_id,
+                opts->pcicards[ctx[i].tx_port_id],
+                cpus->cpus_to_use[cpus->task_lcore[i] + 1], ctx[i].duration,
+                ctx[i].total_pkt, res.sent, res.sent_sz, ctx[i].total_drop, res.pps,
+                res.gbps, res.wire_gbps, get_cycles_per_pkt(cpus, ctx, i));
+        link_speed = get_link_speed(ctx[i].tx_port_id);
+        if (link_speed)
+            fprintf(f, "%f", res.wire_gbps * 1000 * 100 / link_speed);
+        fputc('\n', f);
+    }
+    fprintf(f, "total,,,,%f,%lu,%lu,%lu,%lu,%f,%f,%f,,\n", duration, total_pkt, total_sent,
+            total_sent_sz, total_drop, total_pps, total_gbps, total_wire_gbps);
+    return ;
+}
+
+int write_results(const struct cmd_opts* opts, const struct cpus_bindings* cpus,
+                  const struct thread_ctx* ctx)
+{
+    FILE*   f = stdout;
+
+    if (!opts || !cpus || !ctx)
+        return (EINVAL);
+    if (!opts->results_fmt)
+        return (0);
+
+    if (opts->results_file) {
+        f = fopen(opts->results_file, "w");
+        if (!f) {
+            printf("open of %s failed: %s\n", opts->results_file, strerror(errno));
+            return (errno);
+        }
+    }
+    if (opts->results_fmt == RESULTS_JSON)
+        write_json(f, opts, cpus, ctx);
+    else
+        write_csv(f, opts, cpus, ctx);
+    if (f == stdout) {
+        fflush(f);
+        return (0);
+    }
+    if (fclose(f)) {
+        printf("write of %s failed: %s\n", opts->results_file, strerror(errno));
+        return (errno);
+    }
+    printf("-> Results saved in %s.\n", opts->results_file);
+    return (0);
+}
@@ -0,0 +1,271 @@
+/*
+  SPDX-License-Identifier: BSD-3-Clause
+  Copyright 2018 Jonathan Ribas, FraudBuster. All rights reserved.
+*/
+
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <rte_mbuf.h>
+
+#include "main.h"
+
+/*
+  Rewriting of packet fields on each run (see --rewrite), to turn a small
+  trace into many distinct flows. On run N, a field holds its captured value
+  plus a delta: N, or a pseudo random value drawn for the run. The cached
+  packets being rewritten in place, each run adds the difference with the
+  delta of the previous one. The IPv4 and L4 checksums are updated
+  incrementally (RFC 1624), so only the rewritten words are read.
+*/
+
+static const char*  rw_names[RW_NB_FIELDS] = {
+    "src-mac", "dst-mac", "vlan", "src-ip", "dst-ip", "sport", "dport"
+};
+
+/* width of each field: the low 24 bits of the MACs, keeping their OUI */
+static const uint32_t rw_masks[RW_NB_FIELDS] = {
+    0xffffff, 0xffffff, 0xfff, 0xffffffff, 0xffffffff, 0xffff, 0xffff
+};
+
+#define ETHERTYPE_IPV4  0x0800
+#define ETHERTYPE_IPV6  0x86dd
+#define ETHERTYPE_VLAN  0x8100
+#define ETHERTYPE_QINQ  0x88a8
+#define PROTO_TCP       6
+#define PROTO_UDP       17
+
+static inline uint32_t get_be(const unsigned char* p, const int nb)
+{
+    uint32_t    v;
+    int         i;
+
+    for (i = 0, v = 0; i < nb; i++)
+        v = (v << 8) | p[i];
+    return (v);
+}
+
+static inline void put_be(unsigned char* p, const int nb, uint32_t v)
+{
+    int i;
+
+    for (i = nb - 1; i >= 0; i--, v >>= 8)
+        p[i] = v & 0xff;
+    return ;
+}
+
+/* parse --rewrite FIELD[:incr|:rand][,FIELD...] */
+int str_to_rewrite_fields(struct cmd_opts* opts, char* list)
+{
+    char*   field;
+    char*   mode;
+    char*   save = NULL;
+    int     i;
+
+    if (!opts || !list)
+        return (EINVAL);
+
+    for (field = strtok_r(list, ",", &save); field; field = strtok_r(NULL, ",", &save)) {
+        mode = strchr(field, ':');
+        if (mode)
+            *mode++ = '\0';
+        for (i = 0; i < RW_NB_FIELDS && strcmp(field, rw_names[i]); i++) ;
+        if (i == RW_NB_FIELDS || (mode && strcmp(mode, "incr") && strcmp(mode, "rand"))) {
+            printf("--rewrite: unknown field %s%s%s.\n", field, mode ? ":" : "",
+                   mode ? mode : "");
+            return (EPROTO);
+        }
+        opts->rewrite |= 1 << i;
+        if (mode && !strcmp(mode, "rand"))
+            opts->rewrite_rand |= 1 << i;
+    }
+    return (opts->rewrite ? 0 : EPROTO);
+}
+
+/* find the offsets of the rewritable headers of a packet */
+static void parse_pkt(const unsigned char* p, const uint32_t len, struct rewrite_pkt* rp)
+{
+    unsigned int    off, ihl, l4_off, proto;
+    uint32_t        type;
+
+    bzero(rp, sizeof(*rp));
+    if (len < 14)
+        return ;
+    rp->l2 = 1;
+    for (off = 12, type = get_be(p + off, 2);
+         (type == ETHERTYPE_VLAN || type == ETHERTYPE_QINQ) && off + 6 <= len;
+         off += 4, type = get_be(p + off, 2))
+        if (!rp->vlan_off)
+            rp->vlan_off = off + 2;
+    off += 2;
+
+    if (type == ETHERTYPE_IPV4 && off + 20 <= len) {
+        ihl = (p[off] & 0xf) * 4;
+        if (ihl < 20 || off + ihl > len)
+            return ;
+        rp->l3 = 4;
+        rp->l3_off = off;
+        /* no L4 header in the next fragments */
+        if (get_be(p + off + 6, 2) & 0x1fff)
+            return ;
+        proto = p[off + 9];
+        l4_off = off + ihl;
+    } else if (type == ETHERTYPE_IPV6 && off + 40 <= len) {
+        rp->l3 = 6;
+        rp->l3_off = off;
+        proto = p[off + 6]; /* extension headers are not walked */
+        l4_off = off + 40;
+    } else
+        return ;
+
+    if ((proto == PROTO_TCP && l4_off + 20 <= len) ||
+        (proto == PROTO_UDP && l4_off + 8 <= len)) {
+        rp->l4 = proto;
+        rp->l4_off = l4_off;
+    }
+    return ;
+}
+
+int init_rewrite(const struct cmd_opts* opts, struct pcap_ctx* pcap)
+{
+    unsigned int    i, nb_ip, nb_l4;
+
+    if (!opts || !pcap)
+        return (EINVAL);
+    if (!opts->rewrite)
+        return (0);
+
+    pcap->rw_pkts = malloc(sizeof(*(pcap->rw_pkts)) * pcap->nb_pkts);
+    if (!pcap->rw_pkts) {
+        printf("%s: malloc failed.\n", __FUNCTION__);
+        return (ENOMEM);
+    }
+    for (i = nb_ip = nb_l4 = 0; i < pcap->nb_pkts; i++) {
+        parse_pkt(pcap->map + pcap->pkts[i].offset, pcap->pkts[i].len, &(pcap->rw_pkts[i]));
+        nb_ip += !!pcap->rw_pkts[i].l3;
+        nb_l4 += !!pcap->rw_pkts[i].l4;
+    }
+    printf("-> Rewriting on each run:");
+    for (i = 0; i < RW_NB_FIELDS; i++)
+        if (opts->rewrite & (1 << i))
+            printf(" %s%s", rw_names[i], (opts->rewrite_rand & (1 << i)) ? ":rand" : "");
+    printf(" (%u IP pkts, %u TCP/UDP ones, out of %u).\n", nb_ip, nb_l4, pcap->nb_pkts);
+    return (0);
+}
+
+/* pseudo random delta of a field on a run (splitmix64), none on the first one */
+static inline uint32_t rw_rand_delta(const unsigned long run, const int field)
+{
+    uint64_t    z;
+
+    if (!run)
+        return (0);
+    z = (run * RW_NB_FIELDS + field) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return ((z ^ (z >> 31)) & 0xffffffff);
+}
+
+/* get the differences to add to the fields for the given run */
+void rewrite_run_diff(const unsigned int fields, const unsigned int rand,
+                      const unsigned long run, uint32_t* diff)
+{
+    int i;
+
+    for (i = 0; i < RW_NB_FIELDS; i++) {
+        if (!(fields & (1 << i)))
+            diff[i] = 0;
+        else if (rand & (1 << i))
+            diff[i] = (rw_rand_delta(run, i) - rw_rand_delta(run - 1, i)) & rw_masks[i];
+        else
+            diff[i] = 1;
+    }
+    return ;
+}
+
+/* add a diff to a field, summing the change of its 16 bits words */
+static inline void rw_field(unsigned char* p, const int nb, const uint32_t diff,
+                            const uint32_t mask, uint32_t* sum)
+{
+    uint32_t    old, new;
+
+    old = get_be(p, nb);
+    new = (old & ~mask) | ((old + diff) & mask);
+    put_be(p, nb, new);
+    if (!sum)
+        return ;
+    *sum += (~old & 0xffff) + (new & 0xffff);
+    if (nb > 2)
+        *sum += (~old >> 16 & 0xffff) + (new >> 16);
+    return ;
+}
+
+static inline void rw_cksum(unsigned char* p, uint32_t sum, const int udp)
+{
+    uint32_t    cksum;
+
+    cksum = get_be(p, 2);
+    if (udp && !cksum)
+        return ; /* no UDP checksum */
+    sum += ~cksum & 0xffff;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    cksum = ~sum & 0xffff;
+    put_be(p, 2, (udp && !cksum) ? 0xffff : cksum);
+    return ;
+}
+
+/* rewrite the given mbufs with the diffs of the current run */
+void rewrite_pkts(struct rte_mbuf** mbuf, const struct rewrite_pkt* pkts,
+                  const unsigned int nb, const uint32_t* diff)
+{
+    const struct rewrite_pkt*   rp;
+    unsigned char*              p;
+    unsigned char*              l3;
+    unsigned char*              l4;
+    uint32_t                    ip_sum, port_sum;
+    unsigned int                i, addr_off;
+
+    for (i = 0; i < nb; i++) {
+        rp = &(pkts[i]);
+        if (!rp->l2)
+            continue;
+        p = rte_pktmbuf_mtod(mbuf[i], unsigned char*);
+        if (diff[RW_DST_MAC])
+            rw_field(p + 3, 3, diff[RW_DST_MAC], rw_masks[RW_DST_MAC], NULL);
+        if (diff[RW_SRC_MAC])
+            rw_field(p + 9, 3, diff[RW_SRC_MAC], rw_masks[RW_SRC_MAC], NULL);
+        if (rp->vlan_off && diff[RW_VLAN])
+            rw_field(p + rp->vlan_off, 2, diff[RW_VLAN], rw_masks[RW_VLAN], NULL);
+        if (!rp->l3)
+            continue;
+
+        /* the low 32 bits of the IPv6 addresses */
+        l3 = p + rp->l3_off;
+        addr_off = (rp->l3 == 4 ? 12 : 20);
+        ip_sum = port_sum = 0;
+        if (diff[RW_SRC_IP])
+            rw_field(l3 + addr_off, 4, diff[RW_SRC_IP], rw_masks[RW_SRC_IP], &ip_sum);
+        if (diff[RW_DST_IP])
+            rw_field(l3 + addr_off + (rp->l3 == 4 ? 4 : 16), 4, diff[RW_DST_IP],
+                     rw_masks[RW_DST_IP], &ip_sum);
+        if (rp->l3 == 4 && ip_sum)
+            rw_cksum(l3 + 10, ip_sum, 0);
+        if (!rp->l4)
+            continue;
+
+        /* the L4 checksum covers the addresses, in its pseudo header */
+        l4 = p + rp->l4_off;
+        if (diff[RW_SPORT])
+            rw_field(l4, 2, diff[RW_SPORT], rw_masks[RW_SPORT], &port_sum);
+        if (diff[RW_DPORT])
+            rw_field(l4 + 2, 2, diff[RW_DPORT], rw_masks[RW_DPORT], &port_sum);
+        if (ip_sum || port_sum)
+            rw_cksum(l4 + (rp->l4 == PROTO_TCP ? 16 : 6), ip_sum + port_sum,
+                     rp->l4 == PROTO_UDP);
+    }
+    return ;
+}
@@ -0,0 +1,433 @@
+/*
+  SPDX-License-Identifier: BSD-3-Clause
+  Copyright 2018 Jonathan Ribas, FraudBuster. All rights reserved.
+*/
+
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <rte_version.h>
+#include <rte_ethdev.h>
+#include <rte_launch.h>
+#include <rte_cycles.h>
+
+#include "main.h"
+
+#if API_AT_LEAST_AS_RECENT_AS(20, 5)
+#include <rte_rwlock.h>
+#include <rte_telemetry.h>
+#endif /* API_AT_LEAST_AS_RECENT_AS(20, 5) */
+
+/*
+  Live statistics (see --stats): while the tx lcores replay, the main lcore
+  prints every period the rates of each port, read from the NIC counters,
+  and the counters published by the tasks. Those are kept in their own
+  STATS_ALIGN aligned struct, so that reading them doesn't disturb the cache
+  lines of the tx path.
+*/
+
+int init_stats(const struct cmd_opts* opts, const struct cpus_bindings* cpus,
+               struct stats_ctx* stats)
+{
+    size_t  sz;
+    int     ret;
+
+    if (!opts || !cpus || !stats)
+        return (EINVAL);
+
+    /* the tasks always publish their counters, read or not */
+    stats->nb_tasks = cpus->nb_tasks;
+    sz = sizeof(*(stats->tasks)) * stats->nb_tasks;
+    ret = posix_memalign((void**)&(stats->tasks), STATS_ALIGN, sz);
+    if (ret) {
+        printf("%s: alloc of tasks counters failed.\n", __FUNCTION__);
+        stats->tasks = NULL;
+        return (ret);
+    }
+    bzero(stats->tasks, sz);
+    stats->cpus = cpus;
+    if (opts->tx_hists) {
+        sz = sizeof(*(stats->hists)) * stats->nb_tasks;
+        if (posix_memalign((void**)&(stats->hists), STATS_ALIGN, sz)) {
+            printf("%s: alloc of tx histograms failed.\n", __FUNCTION__);
+            stats->hists = NULL;
+            return (ENOMEM);
+        }
+        bzero(stats->hists, sz);
+    }
+    if (!opts->stats_ms)
+        return (0);
+
+    stats->period_tsc = rte_get_tsc_hz() / 1000 * opts->stats_ms;
+    sz = sizeof(*(stats->prev_tasks)) * stats->nb_tasks;
+    if (posix_memalign((void**)&(stats->prev_tasks), STATS_ALIGN, sz))
+        stats->prev_tasks = NULL;
+    stats->prev_ports = malloc(sizeof(*(stats->prev_ports)) * cpus->nb_ports);
+    if (stats->hists)
+        stats->prev_cycles = malloc(sizeof(*(stats->prev_cycles)) * stats->nb_tasks);
+    if (!stats->prev_tasks || !stats->prev_ports || (stats->hists && !stats->prev_cycles)) {
+        printf("%s: malloc failed.\n", __FUNCTION__);
+        return (ENOMEM);
+    }
+    return (0);
+}
+
+/* lowest value of a histogram bucket, the reverse of hist_bucket() in dpdk.c */
+static uint64_t hist_bucket_value(const unsigned int bucket)
+{
+    unsigned int    exp;
+
+    if (bucket < (2 << HIST_SUB_BITS))
+        return (bucket);
+    exp = (bucket >> HIST_SUB_BITS) - 2 + HIST_SUB_BITS + 1;
+    return ((uint64_t)((1 << HIST_SUB_BITS) | (bucket & ((1 << HIST_SUB_BITS) - 1)))
+            << (exp - HIST_SUB_BITS));
+}
+
+/* value under which pct % of the samples are, at the bucket precision */
+static uint64_t hist_percentile(const struct hist* h, const uint64_t nb, const double pct)
+{
+    uint64_t        sum, rank;
+    unsigned int    i;
+
+    rank = (uint64_t)(nb * pct / 100);
+    for (i = 0, sum = 0; i < HIST_NB_BUCKETS; i++) {
+        sum += h->count[i];
+        if (sum > rank)
+            return (hist_bucket_value(i));
+    }
+    return (h->max);
+}
+
+static uint64_t hist_total(const struct hist* h, double* avg)
+{
+    uint64_t        nb, sum;
+    unsigned int    i;
+
+    for (i = 0, nb = sum = 0; i < HIST_NB_BUCKETS; i++) {
+        nb += h->count[i];
+        sum += h->count[i] * hist_bucket_value(i);
+    }
+    if (avg)
+        *avg = (nb ? (double)sum / nb : 0);
+    return (nb);
+}
+
+static void print_hist(const char* name, const struct hist* h)
+{
+    uint64_t    nb;
+    double      avg;
+
+    nb = hist_total(h, &avg);
+    if (!nb)
+        return ;
+    printf("      %-16s avg %-7.1f p50 %-7lu p90 %-7lu p99 %-7lu p99.9 %-7lu max %lu\n",
+           name, avg, hist_percentile(h, nb, 50), hist_percentile(h, nb, 90),
+           hist_percentile(h, nb, 99), hist_percentile(h, nb, 99.9), h->max);
+    return ;
+}
+
+/* dump the tx burst histograms of a task, see --tx-histograms */
+void print_tx_hists(const struct tx_hists* hists)
+{
+    if (!hists)
+        return ;
+    printf("    tx bursts: %lu calls\n", hist_total(&(hists->cycles), NULL));
+    print_hist("cycles per call", &(hists->cycles));
+    print_hist("pkts per call", &(hists->pkts));
+    return ;
+}
+
+/* take the counters at the replay start, to print differences from them */
+void start_stats(struct stats_ctx* stats)
+{
+    unsigned int    i;
+
+    if (!stats)
+        return ;
+    stats->start_tsc = stats->prev_tsc = rte_rdtsc();
+    if (!stats->period_tsc)
+        return ;
+    for (i = 0; i < stats->nb_tasks; i++) {
+        stats->prev_tasks[i] = stats->tasks[i];
+        if (stats->hists)
+            stats->prev_cycles[i] = stats->hists[i].cycles;
+    }
+    for (i = 0; i < stats->cpus->nb_ports; i++)
+        if (rte_eth_stats_get(i, &(stats->prev_ports[i])))
+            bzero(&(stats->prev_ports[i]), sizeof(stats->prev_ports[i]));
+    stats->next_tsc = stats->start_tsc + stats->period_tsc;
+    return ;
+}
+
+/* print the stats of each port, if the period is over */
+void poll_stats(struct stats_ctx* stats)
+{
+    struct rte_eth_stats    st;
+    struct task_stats       cur;
+    const struct task_stats* prev;
+    struct hist             cycles, cur_cycles;
+    uint64_t                now, drops, full_queues, underruns, nb;
+    double                  elapsed;
+    unsigned int            port, i, j, task;
+
+    if (!stats || !stats->period_tsc)
+        return ;
+    now = rte_rdtsc();
+    if (now < stats->next_tsc)
+        return ;
+    elapsed = (double)(now - stats->prev_tsc) / rte_get_tsc_hz();
+
+    for (port = 0; port < stats->cpus->nb_ports; port++) {
+        if (rte_eth_stats_get(port, &st))
+            bzero(&st, sizeof(st));
+        printf("[%7.1fs] port %02u: %12.0f pps %8.3f Gbit/s",
+               (double)(now - stats->start_tsc) / rte_get_tsc_hz(), port,
+               (st.opackets - stats->prev_ports[port].opackets) / elapsed,
+               (st.obytes - stats->prev_ports[port].obytes) / elapsed * 8 / 1000 / 1000 / 1000);
+        drops = full_queues = underruns = 0;
+        bzero(&cycles, sizeof(cycles));
+        for (i = 0; i < stats->cpus->cores_per_port; i++) {
+            task = port * stats->cpus->cores_per_port + i;
+            cur = stats->tasks[task];
+            prev = &(stats->prev_tasks[task]);
+            drops += cur.drops - prev->drops;
+            full_queues += cur.full_queues - prev->full_queues;
+            underruns += cur.underruns - prev->underruns;
+            /* the share of each core of the port */
+            if (stats->cpus->cores_per_port > 1)
+                printf("%s%.0f", i ? "/" : " (cores: ", (cur.pkts - prev->pkts) / elapsed);
+            stats->prev_tasks[task] = cur;
+            if (!stats->hists)
+                continue;
+            /* the tx bursts of the port during the period */
+            cur_cycles = stats->hists[task].cycles;
+            for (j = 0; j < HIST_NB_BUCKETS; j++)
+                cycles.count[j] += cur_cycles.count[j] - stats->prev_cycles[task].count[j];
+            if (cur_cycles.max > cycles.max)
+                cycles.max = cur_cycles.max;
+            stats->prev_cycles[task] = cur_cycles;
+        }
+        if (stats->cpus->cores_per_port > 1)
+            printf(" pps)");
+        printf(", %lu dropped, %lu full queues", drops, full_queues);
+        if (st.oerrors - stats->prev_ports[port].oerrors)
+            printf(", %lu NIC errors", st.oerrors - stats->prev_ports[port].oerrors);
+        if (underruns)
+            printf(", %lu empty rings", underruns);
+        nb = (stats->hists ? hist_total(&cycles, NULL) : 0);
+        if (nb)
+            printf(", tx burst p50/p99 %lu/%lu cycles", hist_percentile(&cycles, nb, 50),
+                   hist_percentile(&cycles, nb, 99));
+        putchar('\n');
+        stats->prev_ports[port] = st;
+    }
+    stats->prev_tsc = now;
+    stats->next_tsc = now + stats->period_tsc;
+    return ;
+}
+
+/* wait for the end of the tx lcores, printing the stats meanwhile */
+void wait_tx_lcores(const struct cpus_bindings* cpus, struct stats_ctx* stats)
+{
+    unsigned int    i;
+
+    for (i = 0; stats && stats->period_tsc && i < cpus->nb_needed_cpus; ) {
+        if (rte_eal_get_lcore_state(i + 1) != RUNNING) {
+            i++;
+            continue;
+        }
+        usleep(1000);
+        poll_stats(stats);
+    }
+    rte_eal_mp_wait_lcore();
+    return ;
+}
+
+#if API_AT_LEAST_AS_RECENT_AS(20, 5)
+/*
+  Telemetry commands, polled from the DPDK telemetry socket by
+  usertools/dpdk-telemetry.py or the monitoring. Their callbacks take no
+  context, and run from the telemetry thread: they use the replay context
+  under tel_lock, taken for writing by clean_stats before it is freed and
+  the ports are closed.
+*/
+static rte_rwlock_t             tel_lock = RTE_RWLOCK_INITIALIZER;
+static const struct cmd_opts*   tel_opts;
+static const struct dpdk_ctx*   tel_dpdk;
+
+/* /replay/stats: the counters of each port since the replay start */
+static int get_replay_stats(const struct stats_ctx* stats, struct rte_tel_data* d)
+{
+    struct rte_tel_data*    port_d;
+    struct rte_eth_stats    st;
+    struct task_stats       cur;
+    uint64_t                pkts, drops, full_queues, underruns;
+    unsigned int            port, i;
+    char                    name[32];
+
+    if (!stats->tasks)
+        return (-EINVAL);
+    rte_tel_data_start_dict(d);
+    rte_tel_data_add_dict_u64(d, "elapsed_ms", stats->start_tsc ?
+                              (rte_rdtsc() - stats->start_tsc) * 1000 / rte_get_tsc_hz() : 0);
+    for (port = 0; port < stats->cpus->nb_ports; port++) {
+        port_d = rte_tel_data_alloc();
+        if (!port_d)
+            return (-ENOMEM);
+        rte_tel_data_start_dict(port_d);
+        pkts = drops = full_queues = underruns = 0;
+        for (i = 0; i < stats->cpus->cores_per_port; i++) {
+            cur = stats->tasks[port * stats->cpus->cores_per_port + i];
+            pkts += cur.pkts;
+            drops += cur.drops;
+            full_queues += cur.full_queues;
+            underruns += cur.underruns;
+            if (stats->cpus->cores_per_port < 2)
+                continue;
+            snprintf(name, sizeof(name), "core%u_pkts", i);
+            rte_tel_data_add_dict_u64(port_d, name, cur.pkts);
+        }
+        rte_tel_data_add_dict_u64(port_d, "pkts", pkts);
+        rte_tel_data_add_dict_u64(port_d, "dropped", drops);
+        rte_tel_data_add_dict_u64(port_d, "full_queues", full_queues);
+        rte_tel_data_add_dict_u64(port_d, "empty_rings", underruns);
+        if (!rte_eth_stats_get(port, &st)) {
+            rte_tel_data_add_dict_u64(port_d, "nic_opackets", st.opackets);
+            rte_tel_data_add_dict_u64(port_d, "nic_obytes", st.obytes);
+            rte_tel_data_add_dict_u64(port_d, "nic_oerrors", st.oerrors);
+        }
+        snprintf(name, sizeof(name), "port%u", port);
+        rte_tel_data_add_dict_container(d, name, port_d, 0);
+    }
+    return (0);
+}
+
+static int tel_replay_stats(const char* cmd __rte_unused, const char* params __rte_unused,
+                            struct rte_tel_data* d)
+{
+    int ret = -EINVAL;
+
+    rte_rwlock_read_lock(&tel_lock);
+    if (tel_dpdk)
+        ret = get_replay_stats(&(tel_dpdk->stats), d);
+    rte_rwlock_read_unlock(&tel_lock);
+    return (ret);
+}
+
+/*
+  The tx queues and descriptors configured on each port, as adjusted to the
+  NIC limits, once the ports are initialized.
+*/
+static int add_tx_rings_config(const struct dpdk_ctx* dpdk, struct rte_tel_data* d)
+{
+    struct rte_tel_data*    queues_d;
+    struct rte_tel_data*    desc_d;
+    unsigned int            port;
+
+    if (!dpdk->nb_tx_queues || !dpdk->tx_ring_sz)
+        return (0);
+    queues_d = rte_tel_data_alloc();
+    desc_d = rte_tel_data_alloc();
+    if (!queues_d || !desc_d) {
+        rte_tel_data_free(queues_d);
+        rte_tel_data_free(desc_d);
+        return (-ENOMEM);
+    }
+    rte_tel_data_start_array(queues_d, RTE_TEL_U64_VAL);
+    rte_tel_data_start_array(desc_d, RTE_TEL_U64_VAL);
+    for (port = 0; port < dpdk->stats.cpus->nb_ports; port++) {
+        rte_tel_data_add_array_u64(queues_d, dpdk->nb_tx_queues[port]);
+        rte_tel_data_add_array_u64(desc_d, dpdk->nb_tx_queues[port] ?
+                                   dpdk->tx_ring_sz[port] / dpdk->nb_tx_queues[port] : 0);
+    }
+    rte_tel_data_add_dict_container(d, "tx_queues", queues_d, 0);
+    rte_tel_data_add_dict_container(d, "tx_desc", desc_d, 0);
+    return (0);
+}
+
+/* /replay/config: the replay options */
+static int get_replay_config(const struct cmd_opts* opts, const struct dpdk_ctx* dpdk,
+                             struct rte_tel_data* d)
+{
+    char    val[32];
+
+    rte_tel_data_start_dict(d);
+    rte_tel_data_add_dict_string(d, "trace", opts->trace);
+    rte_tel_data_add_dict_int(d, "nb_ports", opts->nb_pcicards);
+    rte_tel_data_add_dict_int(d, "nbruns", opts->nbruns);
+    rte_tel_data_add_dict_int(d, "loop_forever", opts->loop_forever);
+    snprintf(val, sizeof(val), "%f", opts->duration);
+    rte_tel_data_add_dict_string(d, "duration", val);
+    rte_tel_data_add_dict_int(d, "cores_per_port", opts->cores_per_port);
+    snprintf(val, sizeof(val), "%f", opts->maxbitrate);
+    rte_tel_data_add_dict_string(d, "maxbitrate", val);
+    snprintf(val, sizeof(val), "%f", opts->maxpps);
+    rte_tel_data_add_dict_string(d, "maxpps", val);
+    snprintf(val, sizeof(val), "%f", opts->normalspeed ? opts->speed : 0);
+    rte_tel_data_add_dict_string(d, "speed", val);
+    rte_tel_data_add_dict_int(d, "lossless", opts->lossless);
+    rte_tel_data_add_dict_int(d, "burst", opts->burst_sz);
+    rte_tel_data_add_dict_int(d, "stream", opts->stream);
+    rte_tel_data_add_dict_int(d, "shared_cache", opts->shared_cache);
+    rte_tel_data_add_dict_int(d, "zero_copy", opts->zero_copy);
+    return (add_tx_rings_config(dpdk, d));
+}
+
+static int tel_replay_config(const char* cmd __rte_unused, const char* params __rte_unused,
+                             struct rte_tel_data* d)
+{
+    int ret = -EINVAL;
+
+    rte_rwlock_read_lock(&tel_lock);
+    if (tel_opts && tel_dpdk)
+        ret = get_replay_config(tel_opts, tel_dpdk, d);
+    rte_rwlock_read_unlock(&tel_lock);
+    return (ret);
+}
+#endif /* API_AT_LEAST_AS_RECENT_AS(20, 5) */
+
+/* register the /replay/ telemetry commands, once the EAL is up */
+void init_telemetry(const struct cmd_opts* opts __rte_unused,
+                    const struct dpdk_ctx* dpdk __rte_unused)
+{
+#if API_AT_LEAST_AS_RECENT_AS(20, 5)
+    rte_rwlock_write_lock(&tel_lock);
+    tel_opts = opts;
+    tel_dpdk = dpdk;
+    rte_rwlock_write_unlock(&tel_lock);
+    if (rte_telemetry_register_cmd("/replay/stats", tel_replay_stats,
+                                   "Returns the counters of each port since the replay start.") ||
+        rte_telemetry_register_cmd("/replay/config", tel_replay_config,
+                                   "Returns the replay options."))
+        puts("-> Telemetry commands not registered.");
+#endif /* API_AT_LEAST_AS_RECENT_AS(20, 5) */
+    return ;
+}
+
+void clean_stats(struct stats_ctx* stats)
+{
+    if (!stats)
+        return ;
+#if API_AT_LEAST_AS_RECENT_AS(20, 5)
+    /* the commands can't be unregistered: wait for the running ones, make the next ones fail */
+    rte_rwlock_write_lock(&tel_lock);
+    tel_opts = NULL;
+    tel_dpdk = NULL;
+    rte_rwlock_write_unlock(&tel_lock);
+#endif /* API_AT_LEAST_AS_RECENT_AS(20, 5) */
+    free(stats->tasks);
+    free(stats->prev_tasks);
+    free(stats->prev_ports);
+    free(stats->hists);
+    free(stats->prev_cycles);
+    stats->tasks = stats->prev_tasks = NULL;
+    stats->prev_ports = NULL;
+    stats->hists = NULL;
+    stats->prev_cycles = NULL;
+    return ;
+}
@@ -0,0 +1,315 @@
+/*
+  SPDX-License-Identifier: BSD-3-Clause
+  Copyright 2018 Jonathan Ribas, FraudBuster. All rights reserved.
+*/
+
+#define _GNU_SOURCE /* O_DIRECT */
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <rte_version.h>
+#include <rte_mbuf.h>
+#include <rte_ring.h>
+#include <rte_errno.h>
+#include <rte_common.h>
+#include <rte_cycles.h>
+
+#include "main.h"
+
+/*
+  Streaming mode: instead of caching the whole pcap file, the main lcore reads
+  it by chunks of STREAM_CHUNK_SZ and fills one ring of mbufs per NIC port,
+  drained by the tx threads of the port. Each mbuf is shared by all the rings, its refcnt
+  being set to the number of ports.
+*/
+
+int open_stream(const struct cmd_opts* opts, struct pcap_ctx* pcap,
+                struct dpdk_ctx* dpdk)
+{
+    struct stream_ctx*  stream;
+    pcap_hdr_t          pcap_h;
+    struct stat         s;
+    size_t              pad_sz;
+    int                 fd, ret;
+
+    if (!opts || !pcap || !dpdk)
+        return (EINVAL);
+    stream = &(dpdk->stream);
+
+    /* read and check the pcap header */
+    fd = open(opts->trace, O_RDONLY);
+    if (fd < 0) {
+        printf("open of %s failed: %s\n", opts->trace, strerror(errno));
+        return (errno);
+    }
+    if (fstat(fd, &s) || read(fd, &pcap_h, sizeof(pcap_h)) != sizeof(pcap_h)) {
+        printf("%s: read of pcap header failed.\n", __FUNCTION__);
+        close(fd);
+        return (EIO);
+    }
+    close(fd);
+    ret = check_pcap_hdr(&pcap_h);
+    if (ret)
+        return (ret);
+    pcap->cap_sz = s.st_size - sizeof(pcap_hdr_t);
+    printf("streaming %s file (of size: %lu bytes)\n", opts->trace, pcap->cap_sz);
+
+    /* mbufs are sized from the snaplen, up to STREAM_MAX_PKT_SZ */
+    stream->max_pkt_sz = min(pcap_h.snaplen, STREAM_MAX_PKT_SZ);
+    pcap->max_pkt_sz = stream->max_pkt_sz;
+    /* the sizes of the packets are unknown: they all go in the biggest class */
+    pcap->class_max_sz[get_mbuf_class(pcap->max_pkt_sz)] = pcap->max_pkt_sz;
+    if (pcap_h.snaplen > STREAM_MAX_PKT_SZ)
+        printf("-> Packets bigger than %u bytes will be skipped.\n", STREAM_MAX_PKT_SZ);
+
+    /*
+      the read buffer starts with enough room to keep a record cut at the end
+      of the previous chunk, followed by the chunk itself
+    */
+    pad_sz = RTE_ALIGN_CEIL(sizeof(pcaprec_hdr_t) + pcap_h.snaplen, STREAM_ALIGN);
+    stream->buf_sz = pad_sz + STREAM_CHUNK_SZ;
+    ret = posix_memalign((void**)&(stream->buf), STREAM_ALIGN, stream->buf_sz);
+    if (ret) {
+        printf("%s: alloc of read buffer failed.\n", __FUNCTION__);
+        stream->buf = NULL;
+        return (ret);
+    }
+
+    /* bypass the page cache, when the filesystem allows it */
+    stream->fd = open(opts->trace, O_RDONLY | O_DIRECT);
+    stream->direct = 1;
+    if (stream->fd < 0 && errno == EINVAL) {
+        stream->fd = open(opts->trace, O_RDONLY);
+        stream->direct = 0;
+    }
+    if (stream->fd < 0) {
+        printf("open of %s failed: %s\n", opts->trace, strerror(errno));
+        stream->fd = 0;
+        return (errno);
+    }
+    printf("-> Will stream the file %s O_DIRECT.\n", (stream->direct ? "with" : "without"));
+    stream->nbruns = (opts->loop_forever || opts->duration ? 0 : opts->nbruns);
+    return (0);
+}
+
+int init_stream(const struct cmd_opts* opts, const struct cpus_bindings* cpus,
+                struct dpdk_ctx* dpdk)
+{
+    struct stream_ctx*  stream;
+    char                name[RTE_RING_NAMESIZE];
+    unsigned int        i, ring_sz;
+
+    if (!opts || !cpus || !dpdk)
+        return (EINVAL);
+    stream = &(dpdk->stream);
+
+    /* the reader fills the mbufs on --numacore, for all the ports */
+    stream->pool = dpdk->pktmbuf_pools[cpus->numacore][get_mbuf_class(stream->max_pkt_sz)];
+    stream->nb_rings = cpus->nb_ports;
+    stream->rings = malloc(sizeof(*(stream->rings)) * stream->nb_rings);
+    if (!stream->rings) {
+        printf("malloc of stream rings failed.\n");
+        return (ENOMEM);
+    }
+    bzero(stream->rings, sizeof(*(stream->rings)) * stream->nb_rings);
+
+    ring_sz = get_next_power_of_2(opts->prefetch * BURST_SZ);
+    printf("-> Create %u stream rings of %u mbufs.\n", stream->nb_rings, ring_sz);
+    for (i = 0; i < stream->nb_rings; i++) {
+        snprintf(name, sizeof(name), "dpdk_replay_stream_%u", i);
+        /* on the numacore of the tx lcore dequeuing it */
+        stream->rings[i] = rte_ring_create(name, ring_sz, cpus->port_numa[i], RING_F_SP_ENQ);
+        if (!stream->rings[i]) {
+            fprintf(stderr, "DPDK: RTE ring creation failed (%s)\n",
+                    rte_strerror(rte_errno));
+            return (rte_errno);
+        }
+    }
+    return (0);
+}
+
+/* read the next chunk of the file, keeping the unparsed data before it */
+static ssize_t stream_read_chunk(struct stream_ctx* stream)
+{
+    unsigned char*  chunk;
+    size_t          left;
+    ssize_t         nb_read;
+
+    chunk = stream->buf + stream->buf_sz - STREAM_CHUNK_SZ;
+    left = stream->end - stream->pos;
+    if (left > (size_t)(chunk - stream->buf)) {
+        printf("\n%s: record of %lu bytes is bigger than the snaplen.\n",
+               __FUNCTION__, left);
+        errno = EPROTO;
+        return (-1);
+    }
+    memmove(chunk - left, stream->pos, left);
+    stream->pos = chunk - left;
+
+    nb_read = read(stream->fd, chunk, STREAM_CHUNK_SZ);
+    if (nb_read < 0) {
+        printf("\n%s: read failed (%s)\n", __FUNCTION__, strerror(errno));
+        return (-1);
+    }
+    stream->end = chunk + nb_read;
+    return (nb_read);
+}
+
+/* go back to the first packet of the file, for a new run */
+static int stream_rewind(struct stream_ctx* stream)
+{
+    if (lseek(stream->fd, 0, SEEK_SET) == (off_t)(-1)) {
+        printf("\n%s: lseek failed (%s)\n", __FUNCTION__, strerror(errno));
+        return (errno);
+    }
+    stream->pos = stream->end = stream->buf;
+    if (stream_read_chunk(stream) < (ssize_t)sizeof(pcap_hdr_t))
+        return (EIO);
+    stream->pos += sizeof(pcap_hdr_t);
+    return (0);
+}
+
+/*
+  Enqueue the current batch on every ring. When priming, return EAGAIN
+  instead of waiting for a full ring.
+*/
+static int stream_enqueue_batch(struct stream_ctx* stream, const int prime)
+{
+    int stalled = 0;
+
+    while (stream->batch_ring < stream->nb_rings) {
+        if (!rte_ring_enqueue_bulk(stream->rings[stream->batch_ring],
+                                   (void* const*)stream->batch,
+                                   stream->batch_len, NULL)) {
+            if (prime)
+                return (EAGAIN);
+            if (!stalled)
+                stream->nb_stalls++;
+            stalled = 1;
+            rte_pause();
+            continue;
+        }
+        stream->batch_ring++;
+    }
+    stream->batch_len = stream->batch_ring = 0;
+    return (0);
+}
+
+int stream_pcap(struct stream_ctx* stream, const int prime)
+{
+    const pcaprec_hdr_t*    rechdr;
+    struct rte_mbuf*        m;
+    struct timespec         start, end;
+    ssize_t                 nb_read;
+    int                     ret = 0;
+
+    if (!stream)
+        return (EINVAL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!stream->pos)
+        ret = stream_rewind(stream);
+    while (!ret && !stream->done) {
+        /* all runs are read, or the replay is stopped: flush the last batch */
+        if ((stream->nbruns && stream->run_cpt == stream->nbruns) || stream->stop) {
+            if (stream->batch_len)
+                ret = stream_enqueue_batch(stream, prime);
+            if (!ret)
+                stream->done = 1;
+            break;
+        }
+
+        /* enqueue the batch once full */
+        if (stream->batch_len == BURST_SZ) {
+            ret = stream_enqueue_batch(stream, prime);
+            if (ret)
+                break;
+            if (!prime)
+                poll_stats(stream->stats);
+            /* --duration is over or replay interrupted */
+            stream->stop = (stream->quit && *stream->quit) ||
+                (stream->end_tsc && rte_rdtsc() >= stream->end_tsc);
+            continue;
+        }
+
+        /* be sure to have a whole record in the buffer */
+        rechdr = (const pcaprec_hdr_t*)stream->pos;
+        if (stream->pos + sizeof(*rechdr) > stream->end ||
+            stream->pos + sizeof(*rechdr) + rechdr->incl_len > stream->end) {
+            nb_read = stream_read_chunk(stream);
+            if (nb_read < 0)
+                ret = errno;
+            else if (!nb_read) { /* EOF :) */
+                if (stream->pos != stream->end)
+                    printf("\n%s: last record is truncated, ignored.\n", __FUNCTION__);
+                stream->run_cpt++;
+                stream->stop = (stream->quit && *stream->quit) ||
+                    (stream->end_tsc && rte_rdtsc() >= stream->end_tsc);
+                if (!stream->nbruns || stream->run_cpt < stream->nbruns)
+                    ret = stream_rewind(stream);
+            }
+            continue;
+        }
+        stream->pos += sizeof(*rechdr);
+
+        if (unlikely(rechdr->incl_len > stream->max_pkt_sz)) {
+            stream->nb_skipped++;
+            stream->pos += rechdr->incl_len;
+            continue;
+        }
+
+        /* wait for the tx threads to release mbufs if needed */
+        while (unlikely((m = rte_pktmbuf_alloc(stream->pool)) == NULL)) {
+            if (prime) {
+                stream->pos -= sizeof(*rechdr);
+                ret = EAGAIN;
+                break;
+            }
+            rte_pause();
+        }
+        if (ret)
+            break;
+        rte_memcpy((char*)m->buf_addr, stream->pos, rechdr->incl_len);
+        m->data_off = 0;
+        m->data_len = m->pkt_len = rechdr->incl_len;
+        /* released once sent on every port */
+        rte_mbuf_refcnt_set(m, stream->nb_rings);
+        stream->batch[stream->batch_len++] = m;
+        stream->nb_pkts++;
+        stream->read_sz += rechdr->incl_len;
+        stream->pos += rechdr->incl_len;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stream->duration += timespec_diff_to_double(start, end);
+    return (ret == EAGAIN ? 0 : ret);
+}
+
+void clean_stream(struct stream_ctx* stream)
+{
+    unsigned int i;
+
+    if (!stream)
+        return ;
+
+    if (stream->rings) {
+        for (i = 0; i < stream->nb_rings; i++)
+            rte_ring_free(stream->rings[i]);
+        free(stream->rings);
+        stream->rings = NULL;
+    }
+    if (stream->fd) {
+        close(stream->fd);
+        stream->fd = 0;
+    }
+    free(stream->buf);
+    stream->buf = NULL;
+    return ;
+}
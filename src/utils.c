@@ -8,7 +8,7 @@
 
 char*   nb_oct_to_human_str(float size)
 {
-    char*           disp_unit[] = { "o", "Mo", "Mo", "Go", "To" };
+    char*           disp_unit[] = { "o", "Ko", "Mo", "Go", "To" };
     int             i;
     char*           buf = NULL;
         